@@ -0,0 +1,273 @@
+#include "info.h"
+#include "flow.h"
+#include "minors.h"
+
+#ifndef _BATCHH_
+#define _BATCHH_
+
+/*
+ * BATCH ioctl: an array of reads and writes, on any flow of any minor, run in
+ * a single kernel entry. Operations on the same flow are run together, reads
+ * and writes in their order, under a single acquisition of its lock (both
+ * of them with split_locks or spsc) and a single lookup of the minor: the
+ * groups run in the order of their first operation, so an operation may run
+ * ahead of an earlier one on another flow, never on its own. Nothing waits
+ * for bytes or room, as in non-blocking sessions: such operations fail with
+ * -EAGAIN. Deferred writes get sequence numbers (see WRITE_SEQUENCE) on the
+ * minor of the session only. A minor nobody has opened (which has no state,
+ * see minors.h) is not allocated for the batch: its flows are empty, so its
+ * reads fail with -EAGAIN, and its writes fail with -ENODEV.
+ */
+
+#define BATCH_READ 0
+#define BATCH_WRITE 1
+#define BATCH_MAX 1024                    // most operations in a batch
+
+// one operation of a batch, as laid out in user space
+typedef struct _batch_op
+{
+        __u32 minor;
+        __u32 flow;                             // class of the flow.
+        __u32 direction;                        // BATCH_READ or BATCH_WRITE.
+        __u32 flags;                            // none defined yet, must be 0.
+        __u64 buffer;                           // user address of the bytes.
+        __u64 len;
+        __s64 result;                           // written back: bytes read or written, or -errno.
+
+} batch_op;
+
+
+// the argument of the ioctl
+typedef struct _batch
+{
+        __u64 ops;                              // user address of count batch_op.
+        __u32 count;
+        __u32 flags;                            // none defined yet, must be 0.
+
+} batch;
+
+
+long run_batch(session *, batch __user *);
+
+
+// an operation the ioctl can run, with a valid minor and flow
+static int batch_op_valid(batch_op *op) {
+
+   if (op -> minor >= max_minors || op -> flow >= classes || op -> flags != 0 ||
+         (op -> direction != BATCH_READ && op -> direction != BATCH_WRITE))
+      return -EINVAL;
+   if (op -> minor < MINORS && disabled_device[op -> minor])
+      return -ENOENT;
+
+   return 0;
+}
+
+
+static int same_flow(batch_op *op, batch_op *other) {
+   return op -> minor == other -> minor && op -> flow == other -> flow;
+}
+
+
+// as write_flow once the producer lock is held, without waiting for room
+static ssize_t batch_write(object_state *current_stream_state, session *session, const char __user *buff, size_t len) {
+
+   data_segment *new_segment = NULL;
+   size_t res, written;
+   int ret, space, datagram;
+
+   if (unlikely(len == 0))
+      return 0;
+
+   datagram = current_stream_state -> storage != RING_STORAGE && current_stream_state -> datagram;
+   if (datagram && len > (size_t) current_stream_state -> capacity)
+      return -EMSGSIZE;
+
+   space = writable_bytes(current_stream_state);
+   if (space <= 0 || (datagram && (size_t) space < len))
+      return -EAGAIN;
+   len = MIN(len, (size_t) space);
+
+   if (current_stream_state -> storage == RING_STORAGE) {
+      written = ring_write(current_stream_state, buff, len);
+      if (unlikely(written == 0))
+         return -EFAULT;
+   } else {
+      new_segment = alloc_data_segment(len, GFP_KERNEL);
+      if (unlikely(new_segment == NULL))
+         return -ENOMEM;
+
+      res = copy_from_user(new_segment -> buffer, buff, len);
+      if (unlikely(res == len || (res != 0 && datagram)))
+         return free_data_segment(new_segment, EFAULT);
+      written = new_segment -> actual_size = len - res;
+   }
+
+   if ((ret = commit_write(current_stream_state, new_segment, written, current_stream_state -> priority)) < 0)
+      return free_data_segment(new_segment, -ret);
+
+   if (is_deferred(current_stream_state) && current_stream_state == &(session -> device -> flows[current_stream_state -> priority]))
+      queue_sequence(current_stream_state, session);
+
+   return written;
+}
+
+
+// as read_flow once the consumer lock is held, without waiting for bytes
+static ssize_t batch_read(object_state *current_stream_state, char __user *buff, size_t len) {
+
+   int ret;
+
+   if (unlikely(len == 0))
+      return 0;
+   if (!is_readable(current_stream_state, current_stream_state -> priority))
+      return -EAGAIN;
+
+   ret = read(current_stream_state, buff, len);
+   if (ret > 0)
+      trace_multi_flow_dequeue(current_stream_state -> minor, current_stream_state -> priority, ret,
+         atomic_read(&(current_stream_state -> valid_bytes)));
+   account_op(current_stream_state, READ_OP, ret);
+
+   return ret;
+}
+
+
+/*
+ * Runs the operations of the group of ops[first] (see same_flow), which has
+ * been validated, and marks them done. Returns -EINTR if a lock could not be
+ * taken, leaving them undone.
+ */
+static int run_batch_group(session *session, batch_op *ops, u8 *done, int first, int count) {
+
+   minor_state *state;
+   object_state *current_stream_state;
+   batch_op *op = &ops[first];
+   int i, ret = 0, writes = 0, reads = 0, shared;
+
+   for (i = first; i < count; i++) {
+      if (done[i] || !same_flow(op, &ops[i]))
+         continue;
+      writes |= (ops[i].direction == BATCH_WRITE);
+      reads |= (ops[i].direction == BATCH_READ);
+   }
+
+   // the session already holds its own minor, others are held for the group only
+   if (op -> minor == session -> device -> flows[0].minor)
+      state = session -> device;
+   else
+      state = find_minor_state(op -> minor);
+
+   // a minor with no state has empty flows and nowhere to put bytes
+   if (state == NULL) {
+      for (i = first; i < count; i++) {
+         if (done[i] || !same_flow(op, &ops[i]))
+            continue;
+         ops[i].result = (ops[i].direction == BATCH_WRITE) ? -ENODEV : -EAGAIN;
+         done[i] = 1;
+      }
+      return 0;
+   }
+   current_stream_state = &(state -> flows[op -> flow]);
+
+   // without split_locks or spsc both sides share one mutex, taken once for the group
+   if (writes && (ret = producer_lock_interruptible(current_stream_state)) != 0)
+      goto put_state;
+   shared = writes && !current_stream_state -> spsc &&
+      producer_mutex(current_stream_state) == consumer_mutex(current_stream_state);
+   if (reads && !shared && (ret = consumer_lock_interruptible(current_stream_state)) != 0) {
+      if (writes)
+         producer_unlock(current_stream_state);
+      goto put_state;
+   }
+
+   for (i = first; i < count; i++) {
+      if (done[i] || !same_flow(op, &ops[i]))
+         continue;
+      if (ops[i].direction == BATCH_WRITE)
+         ops[i].result = batch_write(current_stream_state, session, u64_to_user_ptr(ops[i].buffer), ops[i].len);
+      else
+         ops[i].result = batch_read(current_stream_state, u64_to_user_ptr(ops[i].buffer), ops[i].len);
+      done[i] = 1;
+   }
+
+   if (reads && !shared)
+      consumer_unlock(current_stream_state);
+   if (writes)
+      producer_unlock(current_stream_state);
+   if (writes)
+      wake_up_after_write(current_stream_state);
+   if (reads)
+      wake_up_after_read(current_stream_state);
+
+put_state:
+   if (state != session -> device)
+      put_minor_state(state);
+
+   return (ret == -ERESTARTSYS) ? -EINTR : ret;
+}
+
+
+/*
+ * The results are written back to the operations. Returns the number of
+ * operations run, all of them unless a signal stopped the batch (the others
+ * are left with -ECANCELED), or a negative error for the batch as a whole.
+ */
+long run_batch(session *session, batch __user *argument) {
+
+   batch request;
+   batch_op *ops;
+   u8 *done;
+   long ret;
+   int i, j, run = 0;
+
+   if (copy_from_user(&request, argument, sizeof(request)) != 0)
+      return -EFAULT;
+   if (request.count == 0 || request.count > BATCH_MAX || request.flags != 0)
+      return -EINVAL;
+
+   ops = kvmalloc(request.count * (sizeof(batch_op) + 1), GFP_KERNEL);
+   if (ops == NULL)
+      return -ENOMEM;
+   done = (u8 *) (ops + request.count);
+
+   if (copy_from_user(ops, u64_to_user_ptr(request.ops), request.count * sizeof(batch_op)) != 0) {
+      kvfree(ops);
+      return -EFAULT;
+   }
+
+   for (i = 0; i < request.count; i++) {
+      ops[i].result = -ECANCELED;
+      ret = batch_op_valid(&ops[i]);
+      if (ret != 0)
+         ops[i].result = ret;
+      done[i] = (ret != 0);
+   }
+
+   for (i = 0; i < request.count; i++) {
+      if (done[i])
+         continue;
+
+      ret = run_batch_group(session, ops, done, i, request.count);
+      if (ret == -EINTR)
+         break;
+      if (ret != 0) {
+         for (j = i; j < request.count; j++) {
+            if (!done[j] && same_flow(&ops[i], &ops[j])) {
+               ops[j].result = ret;
+               done[j] = 1;
+            }
+         }
+      }
+   }
+
+   for (i = 0; i < request.count; i++)
+      run += (ops[i].result != -ECANCELED);
+
+   ret = copy_to_user(u64_to_user_ptr(request.ops), ops, request.count * sizeof(batch_op)) != 0 ? -EFAULT : run;
+   kvfree(ops);
+
+   return ret;
+}
+
+
+#endif
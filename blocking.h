@@ -0,0 +1,439 @@
+#include "info.h"
+#include "multi_flow_trace.h"
+#include "stats.h"
+
+#ifndef _BLOCKINGH_
+#define _BLOCKINGH_
+
+static unsigned long wakeups[MINORS];
+module_param_array(wakeups, ulong, NULL, 0440);
+MODULE_PARM_DESC(wakeups, "Number of times a blocked reader or writer has been woken up, per minor number.");
+
+static unsigned long spurious_wakeups[MINORS];
+module_param_array(spurious_wakeups, ulong, NULL, 0440);
+MODULE_PARM_DESC(spurious_wakeups, "Number of wakeups, per minor number, after which the woken thread " \
+"found nothing to read (or no room to write) and went back to sleep.");
+
+
+int is_readable(object_state *, int);
+int is_writable(object_state *, int);
+int any_readable(object_state *, int);
+int spin_flow(busy_poll *, int (*)(object_state *, int), object_state *, int);
+void account_busy_poll(busy_poll *, u64);
+u64 budget_deadline(wait_budget *, u64);
+u64 budget_left(u64, u64);
+long wait_flow(wait_queue_head_t *, int (*)(object_state *, int), object_state *, int, int, u64);
+int lock_for_write(object_state *, int, int, int, wait_budget *, busy_poll *, int, int);
+int lock_for_read(object_state *, int, int, wait_budget *, busy_poll *, int, int);
+long wait_flows(object_state *, int, u64);
+int wait_readable_flows(object_state *, u64, busy_poll *, int);
+
+
+int is_readable(object_state *the_object, int priority) {
+   return atomic_read(&(the_object -> valid_bytes)) > 0;
+}
+
+
+// room for needed bytes: one for byte streams, a whole record in datagram mode
+int is_writable(object_state *the_object, int needed) {
+   return writable_bytes(the_object) >= needed;
+}
+
+
+// any of the first count flows (of a minor) has bytes to read
+int any_readable(object_state *flows, int count) {
+
+   int i;
+
+   for (i = 0; i < count; i++)
+      if (is_readable(&flows[i], i))
+         return 1;
+
+   return 0;
+}
+
+
+/*
+ * Spins on ready before a blocking operation goes to sleep, so that bytes
+ * (or room) arriving within a few microseconds are taken without a sleep and
+ * a wakeup. The window adapts to the waits of the session: twice their
+ * average, within the limit set by BUSY_POLL, and none at all while they
+ * last longer than the limit. Returns 1 if ready at once, with no wait.
+ */
+int spin_flow(busy_poll *poll, int (*ready)(object_state *, int), object_state *the_object, int arg) {
+
+   u64 limit, average, deadline;
+
+   if (ready(the_object, arg))
+      return 1;
+
+   limit = READ_ONCE(poll -> limit);
+   average = READ_ONCE(poll -> average);
+   if (limit == 0 || average > limit)
+      return 0;
+
+   deadline = ktime_get_ns() + MIN(limit, 2 * average);
+   while (!ready(the_object, arg) && ktime_get_ns() < deadline && !need_resched() && !signal_pending(current))
+      cpu_relax();
+
+   return 0;
+}
+
+
+// a wait of the session, begun at start, moves the average the busy-poll window is drawn from
+void account_busy_poll(busy_poll *poll, u64 start) {
+
+   u64 average, limit = READ_ONCE(poll -> limit);
+
+   if (limit == 0)
+      return;
+
+   // a long sleep (or a timeout) must not keep the window shut for long once arrivals speed up again
+   average = READ_ONCE(poll -> average);
+   WRITE_ONCE(poll -> average, average - (average >> 3) + (MIN(ktime_get_ns() - start, 2 * limit) >> 3));
+}
+
+
+/*
+ * Absolute deadline (CLOCK_MONOTONIC, ns) of a blocking operation starting
+ * at now: the one of the session if set, otherwise now plus its timeout.
+ * KTIME_MAX stands for no deadline at all.
+ */
+u64 budget_deadline(wait_budget *budget, u64 now) {
+
+   u64 deadline = READ_ONCE(budget -> deadline), timeout = READ_ONCE(budget -> timeout);
+
+   if (deadline != 0)
+      return deadline;
+
+   return (timeout >= KTIME_MAX - now) ? KTIME_MAX : now + timeout;
+}
+
+
+// ns left at now before deadline
+u64 budget_left(u64 deadline, u64 now) {
+   return (now >= deadline) ? 0 : deadline - now;
+}
+
+
+// called in TASK_INTERRUPTIBLE state: 1 if woken before deadline, 0 once it is past
+static int sleep_until(u64 deadline) {
+
+   ktime_t expires = ns_to_ktime(deadline);
+
+   // KTIME_MAX sleeps with no timer at all
+   return schedule_hrtimeout(&expires, HRTIMER_MODE_ABS) != 0;
+}
+
+
+/*
+ * Exclusive version of wait_event_interruptible_timeout, on a high resolution
+ * timer expiring at deadline: a wakeup on the queue resumes a single waiter,
+ * which passes it on (see wake_up_after_read and wake_up_after_write) once
+ * done, if there is still something left for the next one. Waiters that may
+ * need more than what a wakeup leaves (datagram writers, whose records take
+ * different room) wait non-exclusively instead: a single exclusive one that
+ * does not fit would go back to sleep with the wakeup, stranding one whose
+ * record fits. Returns 1 when ready, 0 once the deadline is past and
+ * -ERESTARTSYS on signals.
+ */
+long wait_flow(wait_queue_head_t *queue, int (*ready)(object_state *, int), object_state *the_object, int arg, int exclusive,
+   u64 deadline) {
+
+   DEFINE_WAIT(wait);
+   long ret;
+   int woken = 0;
+
+   for (;;) {
+      if (exclusive)
+         prepare_to_wait_exclusive(queue, &wait, TASK_INTERRUPTIBLE);
+      else
+         prepare_to_wait(queue, &wait, TASK_INTERRUPTIBLE);
+
+      if (ready(the_object, arg)) {
+         ret = 1;
+         break;
+      }
+
+      if (woken)
+         count_per_minor(spurious_wakeups, the_object -> minor, 1);
+
+      if (signal_pending(current)) {
+         ret = -ERESTARTSYS;
+         break;
+      }
+
+      if (ktime_get_ns() >= deadline) {
+         ret = 0;
+         break;
+      }
+
+      woken = sleep_until(deadline);
+      if (woken)
+         count_per_minor(wakeups, the_object -> minor, 1);
+   }
+
+   finish_wait(queue, &wait);
+
+   // a wakeup meant for this thread must not get lost if it gives up
+   if (exclusive && ret <= 0 && ready(the_object, arg))
+      wake_up_interruptible(queue);
+
+   return ret;
+}
+
+
+/*
+ * Waits (or just tries, for non-blocking sessions) until there is room for
+ * needed bytes on the flow; on success the producer lock of the flow is held.
+ */
+int lock_for_write(object_state *current_stream_state, int priority, int needed, int blocking, wait_budget *budget,
+   busy_poll *poll, int major, int minor) {
+
+   long ret, err;
+   u64 start, deadline;
+   int waited;
+
+   if(blocking == BLOCKING) {
+
+      AUDIT printk("%s current thread is going to wait for space available for writing on device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME, major, minor);
+
+      start = ktime_get_ns();
+      deadline = budget_deadline(budget, start);
+      trace_multi_flow_wait_start(minor, priority, 1, budget_left(deadline, start));
+
+      inc_pending_threads(current_stream_state);
+      waited = !spin_flow(poll, is_writable, current_stream_state, needed);
+      for (;;) {
+         ret = wait_flow(&(current_stream_state -> writers), is_writable, current_stream_state, needed, needed == 1,
+            deadline);
+         if (ret <= 0)
+            break;
+
+         if ((err = producer_lock_interruptible(current_stream_state)) != 0) {
+            // the wakeup this thread took must reach another writer while there is room
+            if (is_writable(current_stream_state, 1))
+               wake_up_writers(current_stream_state);
+            ret = err;
+            break;
+         }
+         if (is_writable(current_stream_state, needed))
+            break;
+
+         // somebody else filled the flow in the meanwhile
+         producer_unlock(current_stream_state);
+         count_per_minor(spurious_wakeups, minor, 1);
+      }
+      dec_pending_threads(current_stream_state);
+      if (waited && ret >= 0)
+         account_busy_poll(poll, start);
+      trace_multi_flow_wait_end(minor, priority, 1, ret);
+      account_wait(current_stream_state, start);
+
+      AUDIT printk("%s current thread has waken up from wait queue related to device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME, major, minor);
+
+      if(ret == 0) {
+         trace_multi_flow_timeout(minor, priority, 1, budget_left(deadline, start));
+         AUDIT printk("%s timer has expired for current thread and cannot write on device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME, major, minor);
+
+         return -ETIME;
+
+      } else if(ret == -ERESTARTSYS) {
+         AUDIT printk("%s current thread received a signal while waiting for space on device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME, major, minor);
+
+         return -EINTR;
+      } else if(ret < 0) {
+         return ret;
+      }
+   } else {
+            if (!producer_trylock(current_stream_state))
+                     return -EBUSY;
+
+            if (unlikely(!is_writable(current_stream_state, needed))) {
+                     producer_unlock(current_stream_state);
+                     return -EAGAIN;
+            }
+   }
+
+   return 0;
+}
+
+
+/*
+ * Waits (or just tries, for non-blocking sessions) until there are bytes to
+ * read on the flow; on success the consumer lock of the flow is held.
+ */
+int lock_for_read(object_state *current_stream_state, int priority, int blocking, wait_budget *budget, busy_poll *poll,
+   int major, int minor) {
+
+   long ret, err;
+   u64 start, deadline;
+   int waited;
+
+   if (blocking == BLOCKING) {
+
+      AUDIT printk("%s current thread is waiting for bytes to read from device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME , major, minor);
+
+      start = ktime_get_ns();
+      deadline = budget_deadline(budget, start);
+      trace_multi_flow_wait_start(minor, priority, 0, budget_left(deadline, start));
+
+      inc_pending_threads(current_stream_state);
+      waited = !spin_flow(poll, is_readable, current_stream_state, priority);
+      for (;;) {
+         ret = wait_flow(&(current_stream_state -> readers), is_readable, current_stream_state, priority, 1, deadline);
+         if (ret <= 0)
+            break;
+
+         if ((err = consumer_lock_interruptible(current_stream_state)) != 0) {
+            // the wakeup this thread took must reach another reader while there are bytes
+            if (is_readable(current_stream_state, priority))
+               wake_up_readers(current_stream_state);
+            ret = err;
+            break;
+         }
+         if (is_readable(current_stream_state, priority))
+            break;
+
+         // somebody else drained the flow in the meanwhile
+         consumer_unlock(current_stream_state);
+         count_per_minor(spurious_wakeups, minor, 1);
+      }
+      dec_pending_threads(current_stream_state);
+      if (waited && ret >= 0)
+         account_busy_poll(poll, start);
+      trace_multi_flow_wait_end(minor, priority, 0, ret);
+      account_wait(current_stream_state, start);
+
+      AUDIT printk("%s current thread has woken up from wait queue related to device %s [MAJOR: %d, minor: %d]",
+         MODNAME, DEVICE_NAME , major, minor);
+
+      if(ret == 0) {
+         trace_multi_flow_timeout(minor, priority, 0, budget_left(deadline, start));
+         AUDIT printk("%s timer has expired for current thread and it is not possible to read from device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME, major, minor);
+
+         return -ETIME;
+      } else if(ret == -ERESTARTSYS) {
+         AUDIT printk("%s current thread was hit with a signal while waiting for bytes to read on device %s [MAJOR: %d, minor: %d]",
+            MODNAME, DEVICE_NAME, major, minor);
+
+         return -EINTR;
+      } else if(ret < 0) {
+         return ret;
+      }
+   } else {
+      if (!consumer_trylock(current_stream_state))
+         return -EBUSY;
+   }
+
+   return 0;
+}
+
+
+/*
+ * Waits until any of the first count flows has bytes to read, for a combined
+ * read. Unlike wait_flow the wait is not exclusive, on every queue: an
+ * exclusive wakeup of one flow handed to a thread that ends up reading
+ * another would be lost for its own readers. Returns as wait_flow.
+ */
+long wait_flows(object_state *flows, int count, u64 deadline) {
+
+   wait_queue_entry_t waits[DATA_FLOWS];
+   long ret;
+   int i, readable;
+
+   for (i = 0; i < count; i++)
+      init_wait(&waits[i]);
+
+   for (;;) {
+      readable = 0;
+      for (i = 0; i < count; i++) {
+         prepare_to_wait(&(flows[i].readers), &waits[i], TASK_INTERRUPTIBLE);
+         readable |= is_readable(&flows[i], i);
+      }
+
+      if (readable) {
+         ret = 1;
+         break;
+      }
+
+      if (signal_pending(current)) {
+         ret = -ERESTARTSYS;
+         break;
+      }
+
+      if (ktime_get_ns() >= deadline) {
+         ret = 0;
+         break;
+      }
+
+      if (sleep_until(deadline))
+         count_per_minor(wakeups, flows[0].minor, 1);
+   }
+
+   for (i = 0; i < count; i++)
+      finish_wait(&(flows[i].readers), &waits[i]);
+
+   return ret;
+}
+
+
+/*
+ * Blocking side of a combined read of the classes of a minor (flows, indexed
+ * by class): waits for bytes on any of them until deadline, which the read
+ * keeps across its waits.
+ */
+int wait_readable_flows(object_state *flows, u64 deadline, busy_poll *poll, int major) {
+
+   long ret;
+   u64 start;
+   int i, waited, minor = flows[0].minor;
+
+   AUDIT printk("%s current thread is waiting for bytes to read from every flow of device %s [MAJOR: %d, minor: %d]",
+         MODNAME, DEVICE_NAME, major, minor);
+
+   start = ktime_get_ns();
+   trace_multi_flow_wait_start(minor, -1, 0, budget_left(deadline, start));
+
+   for (i = 0; i < classes; i++)
+      inc_pending_threads(&flows[i]);
+   // a spin that found bytes is no wait to learn from
+   waited = !spin_flow(poll, any_readable, flows, classes);
+   ret = waited ? wait_flows(flows, classes, deadline) : 1;
+   for (i = 0; i < classes; i++)
+      dec_pending_threads(&flows[i]);
+   if (waited && ret >= 0)
+      account_busy_poll(poll, start);
+
+   trace_multi_flow_wait_end(minor, -1, 0, ret);
+
+   // filed under the first class a combined read drains, or every class if none has bytes
+   for (i = classes - 1; i >= 0 && !is_readable(&flows[i], i); i--)
+      ;
+   if (i >= 0) {
+      account_wait(&flows[i], start);
+   } else {
+      for (i = 0; i < classes; i++)
+         account_wait(&flows[i], start);
+   }
+
+   if (ret == 0) {
+      trace_multi_flow_timeout(minor, -1, 0, budget_left(deadline, start));
+      return -ETIME;
+   } else if (ret == -ERESTARTSYS) {
+      return -EINTR;
+   } else if (ret < 0) {
+      return ret;
+   }
+
+   return 0;
+}
+
+
+#endif
@@ -0,0 +1,540 @@
+#include "info.h"
+#include "read.h"
+#include "write.h"
+#include "blocking.h"
+#include "stats.h"
+
+#ifndef _FLOWH_
+#define _FLOWH_
+
+/*
+ * Read and write paths of a flow, independent of the file they are reached
+ * from: multi_flow.c calls them with the flow selected by the session, and
+ * user/engine builds them in user space for benchmarks and fuzzing.
+ */
+
+int is_deferred(object_state *);
+int commit_write(object_state *, data_segment *, size_t, int);
+int stream_write(object_state *, const char __user *, size_t, int, gfp_t);
+ssize_t write_flow(object_state *, session *, const char __user *, size_t, int);
+ssize_t write_iter_flow(object_state *, session *, int, struct iov_iter *, struct kiocb *, int);
+int begin_read(object_state *, session *, int, int);
+void end_read(object_state *, int);
+ssize_t read_flow(object_state *, session *, char __user *, size_t, int);
+ssize_t read_iter_flow(object_state *, session *, int, struct iov_iter *, int);
+ssize_t read_flows(object_state *, session *, int, char __user *, size_t, struct iov_iter *, int);
+
+
+// spsc rings commit synchronously whatever the class
+int is_deferred(object_state *current_stream_state) {
+   return current_stream_state -> deferred && !current_stream_state -> spsc;
+}
+
+
+/*
+ * Appends a segment, or the len bytes just copied in the ring when
+ * new_segment is NULL, synchronously or through deferred work as the class
+ * of the flow is set by class_deferred (see is_deferred). Called with the
+ * lock held.
+ */
+int commit_write(object_state *current_stream_state, data_segment *new_segment, size_t len, int priority) {
+
+   int ret;
+
+   if (!is_deferred(current_stream_state)) {
+            // nobody else may commit on a spsc ring, the bytes just reserved go straight to the reader
+            if (new_segment != NULL)
+                     write( new_segment, current_stream_state );
+            else
+                     ring_commit(current_stream_state, len);
+            ret = len;
+   } else if ((ret = put_work(current_stream_state, new_segment, len)) < 0) {
+            if (new_segment == NULL)
+                     ring_unreserve(current_stream_state, len);
+            return ret;
+   }
+
+   trace_multi_flow_enqueue(current_stream_state -> minor, priority, len, atomic_read(&(current_stream_state -> valid_bytes)));
+   account_op(current_stream_state, WRITE_OP, ret);
+
+   return ret;
+}
+
+
+/*
+ * Stream mode: len bytes are copied into the spare room of the last segment
+ * (see packing_target) when they fit, otherwise into a new segment with a
+ * payload of STREAM_CHUNK bytes that the next small writes fill in turn, so
+ * that a burst of small writes makes a few page-sized segments instead of
+ * one per call. The chunk is only worth it if the new segment can be packed
+ * into: the visible tail when readers share the lock, or a pending list that
+ * already holds a segment (a single write is likely drained before the next
+ * one); otherwise the segment gets len bytes, as in write_flow. Called with
+ * the lock held.
+ */
+int stream_write(object_state *current_stream_state, const char __user *buff, size_t len, int priority, gfp_t flags) {
+
+   data_segment *target, *new_segment;
+   size_t res;
+   int ret, chunk, deferred = is_deferred(current_stream_state);
+
+   target = packing_target(current_stream_state, deferred);
+
+   if (target == NULL || segment_room(target) < len) {
+            chunk = deferred ? (target != NULL) : !current_stream_state -> split_locks;
+            new_segment = alloc_data_segment(chunk ? STREAM_CHUNK : len, flags);
+            if (unlikely(new_segment == NULL))
+                     return -ENOMEM;
+
+            res = copy_from_user(new_segment -> buffer, buff, len);
+            if (unlikely(res == len))
+                     return free_data_segment(new_segment, EFAULT);
+
+            new_segment -> actual_size = len - res;
+            if ((ret = commit_write(current_stream_state, new_segment, len - res, priority)) < 0)
+                     free_data_segment(new_segment, 0);
+            return ret;
+   }
+
+   res = copy_from_user(target -> buffer + target -> actual_size, buff, len);
+   if (unlikely(res == len))
+            return -EFAULT;
+   len -= res;
+
+   if (deferred) {
+            if ((ret = put_work(current_stream_state, NULL, len)) < 0)
+                     return ret;
+            target -> actual_size += len;
+   } else {
+            // packing_target never returns a visible segment with split_locks, so readers hold
+            // this same lock and the bytes only have to be accounted for (see packing_target)
+            target -> actual_size += len;
+            smp_mb__before_atomic();
+            atomic_add(len, &(current_stream_state -> valid_bytes));
+   }
+
+   trace_multi_flow_enqueue(current_stream_state -> minor, priority, len, atomic_read(&(current_stream_state -> valid_bytes)));
+   account_op(current_stream_state, WRITE_OP, len);
+
+   return len;
+}
+
+
+ssize_t write_flow(object_state *current_stream_state, session *session, const char __user *buff, size_t len, int major) {
+
+   int ret, res, priority, blocking, minor, datagram, needed;
+   gfp_t flags;
+   data_segment *new_segment;
+
+   minor = current_stream_state -> minor;
+   priority = session -> priority;
+   blocking = session -> blocking;
+
+   if (unlikely(len == 0))
+            return 0;
+
+   flags = (blocking == BLOCKING) ? GFP_KERNEL : GFP_ATOMIC;
+   needed = 1;
+
+   if (current_stream_state -> storage == RING_STORAGE) {
+            // bytes are copied straight into the ring once the lock is held
+            new_segment = NULL;
+            res = 0;
+            goto acquire;
+   }
+
+   datagram = READ_ONCE(current_stream_state -> datagram);
+   if (datagram) {
+            // a record is never truncated: it waits for room as a whole, or does not fit at all
+            if (len > (size_t) READ_ONCE(current_stream_state -> capacity))
+                     return -EMSGSIZE;
+            needed = len;
+   }
+
+   // a flow never holds more than its capacity, anything beyond is truncated anyway
+   len = MIN(len, (size_t) READ_ONCE(current_stream_state -> capacity));
+
+   if (session -> stream && !datagram && len <= STREAM_CHUNK) {
+            // copied once the lock is held, into the segment it is packed into
+            new_segment = NULL;
+            res = 0;
+            goto acquire;
+   }
+
+   new_segment = alloc_data_segment(len, flags);
+   if (unlikely(new_segment == NULL))
+            return -ENOMEM;
+
+   res = copy_from_user(new_segment -> buffer, buff, len);
+
+   if (unlikely(res == len))
+            return free_data_segment(new_segment, ENOMEM);
+   if (unlikely(res != 0 && datagram))
+            return free_data_segment(new_segment, EFAULT);
+
+acquire:
+   if ((ret = lock_for_write(current_stream_state, priority, needed, blocking, &(session -> budget), &(session -> poll), major,
+      minor)) < 0) {
+            account_op(current_stream_state, WRITE_OP, ret);
+            return free_data_segment(new_segment, -ret);
+   }
+
+   if (current_stream_state -> storage == RING_STORAGE) {
+            ret = ring_write(current_stream_state, buff, MIN(len, writable_bytes(current_stream_state)));
+            if (unlikely(ret == 0)) {
+                     producer_unlock(current_stream_state);
+                     wake_up_after_write(current_stream_state);
+                     return -EFAULT;
+            }
+   } else if (new_segment == NULL) {
+            ret = writable_bytes(current_stream_state);
+            if (ret > 0 && (ret = stream_write(current_stream_state, buff, MIN(len, ret), priority, flags)) < 0) {
+                     producer_unlock(current_stream_state);
+                     wake_up_after_write(current_stream_state);
+                     return ret;
+            }
+            goto committed;
+   } else {
+            new_segment-> actual_size = MIN(len - res, writable_bytes(current_stream_state));
+            ret = new_segment -> actual_size;
+   }
+
+   if ((res = commit_write(current_stream_state, new_segment, ret, priority)) < 0) {
+            producer_unlock(current_stream_state);
+            // It gives the possibility to other threads to try to write
+            wake_up_after_write(current_stream_state);
+            return free_data_segment(new_segment, -res);
+   }
+
+committed:
+   if (ret > 0 && is_deferred(current_stream_state))
+            queue_sequence(current_stream_state, session);
+
+   producer_unlock(current_stream_state);
+   wake_up_after_write(current_stream_state);
+
+   return ret;
+}
+
+
+/*
+ * All the iovecs are appended under a single acquisition of the lock, as one
+ * segment or as one segment per iovec depending on the session. In datagram
+ * mode those segments are records, and the call waits for room for all of
+ * them.
+ *
+ * iocb is the kiocb of an asynchronous (io_uring or AIO) call, NULL otherwise:
+ * a deferred low priority write then returns -EIOCBQUEUED and the kiocb is
+ * completed by the deferred run that makes its bytes visible. Without memory
+ * for the completion record the write just completes synchronously.
+ */
+ssize_t write_iter_flow(object_state *current_stream_state, session *session, int blocking, struct iov_iter *from,
+   struct kiocb *iocb, int major) {
+
+   int ret, res, priority, minor, datagram, needed;
+   size_t len, written, space;
+   gfp_t flags;
+   data_segment *chain, *new_segment;
+   write_completion *completion;
+
+   minor = current_stream_state -> minor;
+   priority = session -> priority;
+
+   len = MIN(iov_iter_count(from), (size_t) READ_ONCE(current_stream_state -> capacity));
+   if (unlikely(len == 0))
+            return 0;
+
+   datagram = current_stream_state -> storage != RING_STORAGE && READ_ONCE(current_stream_state -> datagram);
+   needed = 1;
+   if (datagram) {
+            if (len < iov_iter_count(from))
+                     return -EMSGSIZE;
+            needed = len;
+   }
+
+   flags = (blocking == BLOCKING) ? GFP_KERNEL : GFP_ATOMIC;
+
+   chain = NULL;
+   if (current_stream_state -> storage != RING_STORAGE) {
+            ret = build_segments(from, len, session -> iovec_segments, flags, &chain);
+            if (unlikely(ret <= 0))
+                     return (ret == 0) ? -EFAULT : ret;
+            if (unlikely(ret < len && datagram)) {
+                     free_segment_chain(chain);
+                     return -EFAULT;
+            }
+   }
+
+   completion = NULL;
+   if (iocb != NULL && is_deferred(current_stream_state))
+            completion = kmalloc(sizeof(write_completion), flags);
+
+   if ((ret = lock_for_write(current_stream_state, priority, needed, blocking, &(session -> budget), &(session -> poll), major,
+      minor)) < 0) {
+            account_op(current_stream_state, WRITE_OP, ret);
+            free_segment_chain(chain);
+            kfree(completion);
+            return ret;
+   }
+
+   if (current_stream_state -> storage == RING_STORAGE) {
+            written = ring_write_iter(current_stream_state, from, MIN(len, writable_bytes(current_stream_state)));
+            if (unlikely(written == 0))
+                     ret = -EFAULT;
+            else if ((ret = commit_write(current_stream_state, NULL, written, priority)) > 0)
+                     ret = written;
+   } else {
+            written = 0;
+            ret = 0;
+            while (chain != NULL && (space = writable_bytes(current_stream_state)) > 0) {
+                     new_segment = chain;
+                     chain = chain -> next;
+
+                     new_segment -> actual_size = MIN(new_segment -> actual_size, space);
+                     if ((res = commit_write(current_stream_state, new_segment, new_segment -> actual_size, priority)) < 0) {
+                              free_data_segment(new_segment, 0);
+                              ret = res;
+                              break;
+                     }
+                     written += res;
+            }
+            free_segment_chain(chain);
+            if (written > 0)
+                     ret = written;
+   }
+
+   if (ret > 0 && is_deferred(current_stream_state))
+            queue_sequence(current_stream_state, session);
+
+   if (completion != NULL && ret > 0 && is_deferred(current_stream_state)) {
+            queue_completion(current_stream_state, completion, iocb, ret);
+            completion = NULL;
+            ret = -EIOCBQUEUED;
+   }
+   kfree(completion);
+
+   producer_unlock(current_stream_state);
+   wake_up_after_write(current_stream_state);
+
+   return ret;
+}
+
+
+// on success the consumer lock of the flow is held until end_read
+int begin_read(object_state *current_stream_state, session *session, int blocking, int major) {
+
+   int ret;
+
+   AUDIT printk("%s current thread has called a read on %s device [MAJOR: %d, minor: %d]",
+         MODNAME, DEVICE_NAME, major, current_stream_state -> minor);
+
+   ret = lock_for_read(current_stream_state, session -> priority, blocking, &(session -> budget), &(session -> poll), major,
+      current_stream_state -> minor);
+   if (ret < 0)
+      account_op(current_stream_state, READ_OP, ret);
+
+   return ret;
+}
+
+
+void end_read(object_state *current_stream_state, int ret) {
+
+   if (ret > 0)
+            trace_multi_flow_dequeue(current_stream_state -> minor, current_stream_state -> priority, ret,
+                     atomic_read(&(current_stream_state -> valid_bytes)));
+   account_op(current_stream_state, READ_OP, ret);
+
+   consumer_unlock(current_stream_state);
+   wake_up_after_read(current_stream_state);
+}
+
+
+ssize_t read_flow(object_state *current_stream_state, session *session, char __user *buff, size_t len, int major) {
+
+   int ret;
+
+   if (unlikely(len == 0))
+            return 0;
+
+   if ((ret = begin_read(current_stream_state, session, session -> blocking, major)) < 0)
+            return ret;
+
+   ret = read(current_stream_state, buff, len);
+   end_read(current_stream_state, ret);
+
+   return ret;
+}
+
+
+// the iovecs are filled in FIFO order under a single acquisition of the lock
+ssize_t read_iter_flow(object_state *current_stream_state, session *session, int blocking, struct iov_iter *to, int major) {
+
+   int ret;
+
+   if (unlikely(iov_iter_count(to) == 0))
+            return 0;
+
+   if ((ret = begin_read(current_stream_state, session, blocking, major)) < 0)
+            return ret;
+
+   ret = read_to_iter(current_stream_state, to);
+   end_read(current_stream_state, ret);
+
+   return ret;
+}
+
+
+/*
+ * Reads from one flow of a combined read (see read_flows), without waiting
+ * for bytes: into buff, or into to when it is not NULL. The lock is waited
+ * for only by blocking sessions.
+ */
+static int read_one_flow(object_state *current_stream_state, int blocking, char __user *buff, size_t len,
+   struct iov_iter *to) {
+
+   int ret;
+
+   if (blocking == BLOCKING)
+            ret = consumer_lock_interruptible(current_stream_state);
+   else
+            ret = consumer_trylock(current_stream_state) ? 0 : -EBUSY;
+   if (ret != 0) {
+            account_op(current_stream_state, READ_OP, ret);
+            return ret;
+   }
+
+   ret = (to != NULL) ? read_to_iter(current_stream_state, to) : read(current_stream_state, buff, len);
+   end_read(current_stream_state, ret);
+
+   return ret;
+}
+
+
+// COMBINED_READ: the classes are drained in priority order, the highest first
+static int read_strict_priority(object_state *flows, int blocking, char __user *buff, size_t len,
+   struct iov_iter *to, size_t *read_bytes) {
+
+   int ret = -EAGAIN, i;
+
+   for (i = classes - 1; i >= 0 && *read_bytes < len; i--) {
+            if (!is_readable(&flows[i], i))
+                     continue;
+
+            ret = read_one_flow(&flows[i], blocking, buff + *read_bytes, len - *read_bytes, to);
+            if (ret > 0)
+                     *read_bytes += ret;
+            else if (ret != -EAGAIN)
+                     break;
+
+            if (ret > 0 && flows[i].datagram)
+                     break;
+   }
+
+   return ret;
+}
+
+
+/*
+ * DRR_READ: deficit round robin over the classes. On its turn a class gets
+ * its weight times DRR_QUANTUM bytes more of deficit, and is read until the
+ * deficit is spent or it is empty (which also clears the deficit); the turn
+ * then passes to the next class. The turn and the deficits are kept by the
+ * session across reads, so that a small buffer does not restart the round.
+ * A record is read whole, even past the deficit, which then goes negative.
+ */
+static int read_deficit_round_robin(object_state *flows, session *session, int blocking, char __user *buff, size_t len,
+   struct iov_iter *to, size_t *read_bytes) {
+
+   object_state *current_stream_state;
+   size_t count, quota;
+   int ret = -EAGAIN, class, idle = 0;
+
+   while (*read_bytes < len) {
+            class = session -> drr_class;
+            current_stream_state = &flows[class];
+
+            if (session -> deficit[class] > 0 && is_readable(current_stream_state, class)) {
+                     quota = current_stream_state -> datagram ? len - *read_bytes :
+                              MIN(len - *read_bytes, (size_t) session -> deficit[class]);
+                     if (to != NULL) {
+                              count = iov_iter_count(to);
+                              iov_iter_truncate(to, quota);
+                              ret = read_one_flow(current_stream_state, blocking, NULL, 0, to);
+                              iov_iter_reexpand(to, count - (ret > 0 ? ret : 0));
+                     } else {
+                              ret = read_one_flow(current_stream_state, blocking, buff + *read_bytes, quota, NULL);
+                     }
+
+                     if (ret > 0) {
+                              *read_bytes += ret;
+                              session -> deficit[class] -= ret;
+                              idle = 0;
+                              if (current_stream_state -> datagram)
+                                       break;
+                              continue;
+                     }
+                     if (ret != -EAGAIN)
+                              break;
+            }
+
+            // the turn of the class is over: its deficit is spent, or it is empty
+            if (!is_readable(current_stream_state, class)) {
+                     session -> deficit[class] = 0;
+                     if (++idle == classes)
+                              break;
+            } else {
+                     idle = 0;
+            }
+
+            class = (class + 1) % classes;
+            session -> drr_class = class;
+            session -> deficit[class] += flows[class].weight * DRR_QUANTUM;
+   }
+
+   return ret;
+}
+
+
+/*
+ * Combined read of the classes of a minor (flows, indexed by class), in
+ * priority order or in deficit round robin depending on the read mode of the
+ * session: the classes fill the buffer (or the iterator, when to is not NULL)
+ * one after the other. Each flow is locked in turn, without waiting for
+ * bytes: a blocking session waits on every flow at once, and only when all
+ * of them are empty. In datagram mode only the records of one flow are read.
+ */
+ssize_t read_flows(object_state *flows, session *session, int blocking, char __user *buff, size_t len, struct iov_iter *to,
+   int major) {
+
+   size_t read_bytes;
+   u64 deadline;
+   int ret;
+
+   if (to != NULL)
+            len = iov_iter_count(to);
+   if (unlikely(len == 0))
+            return 0;
+
+   // the waits of the read share its budget
+   deadline = (blocking == BLOCKING) ? budget_deadline(&(session -> budget), ktime_get_ns()) : 0;
+
+   for (;;) {
+            read_bytes = 0;
+            if (session -> read_mode == DEFICIT_ROUND_ROBIN)
+                     ret = read_deficit_round_robin(flows, session, blocking, buff, len, to, &read_bytes);
+            else
+                     ret = read_strict_priority(flows, blocking, buff, len, to, &read_bytes);
+
+            if (read_bytes > 0)
+                     return read_bytes;
+            if (ret != -EAGAIN || blocking != BLOCKING)
+                     return (ret == -ERESTARTSYS) ? -EINTR : ret;
+
+            // every flow was empty (or drained by somebody else in the meanwhile)
+            if ((ret = wait_readable_flows(flows, deadline, &(session -> poll), major)) < 0)
+                     return ret;
+   }
+}
+
+
+#endif
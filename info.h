@@ -18,6 +18,14 @@
 #include <linux/moduleparam.h>
 #include <linux/jiffies.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/math64.h>
+#include <linux/jump_label.h>
+#include <linux/xarray.h>
 
 MODULE_AUTHOR("Gianmarco Bencivenni");
 MODULE_DESCRIPTION("Multi-flow device file");
@@ -26,40 +34,142 @@ MODULE_LICENSE("GPL");
 #define MODNAME "MULTI-FLOW-DEVICE-FILE"
 #define DEVICE_NAME "my-device" /* Device file name in /dev/ - not mandatory  */
 
-#define MINORS 128
-#define DATA_FLOWS 2
-#define LOW_PRIORITY 0
-#define HIGH_PRIORITY 1
+#define MINORS 128                        // minors with per-minor parameters, see max_minors for the others
+#define MAX_MINORS (MINORMASK + 1)
+#define DATA_FLOWS 8                      // most priority classes (flows) a minor can have, see classes
+#define LOW_PRIORITY 0                    // the class selected by ioctl 3, deferred by default
+#define DRR_QUANTUM 1024                  // bytes a class of weight 1 is read for in each round of DRR_READ
 #define BLOCKING 0
 #define NON_BLOCKING 1
-#define OBJECT_MAX_SIZE  (4096) //just one page
+#define SEGMENT_STORAGE 0
+#define RING_STORAGE 1
+#define OBJECT_MAX_SIZE  (4096) //just one page: default, and minimum, capacity of a flow
+#define MAX_CAPACITY (64 << 20)           // largest capacity of a flow
+#define CONSUME_BYTES 8                   // ioctl: release bytes drained in place from an mmap'ed ring
+#define SEGMENT_PER_IOVEC 9               // ioctl: writev() appends one segment per iovec (param != 0)
+#define SPSC_MODE 10                      // ioctl: switch the minor to (param != 0) or from spsc mode, sole session only
+#define SET_CAPACITY 11                   // ioctl: resize both flows of the minor to param bytes
+#define BIND_EVENTFD 12                   // ioctl: signal eventfd param on each commit of the session's deferred writes (-1 unbinds)
+#define WRITE_SEQUENCE 13                 // ioctl: stores at param (__u64) the sequence number of the session's last deferred write
+#define COMMITTED_SEQUENCE 14             // ioctl: stores at param (__u64) the sequence number of the session's last committed one
+#define STREAM_MODE 15                    // ioctl: small write() calls are packed into the last segment (param != 0)
+#define DATAGRAM_MODE 16                  // ioctl: switch the minor to (param != 0) or from datagram mode, sole session only
+#define NEXT_RECORD_SIZE 17               // ioctl: returns the size of the next record of the session's flow (0 if none)
+#define COMBINED_READ 18                  // ioctl: reads drain the classes in priority order, highest first (param != 0)
+#define SET_CLASS 19                      // ioctl: the session reads and writes the flow of class param
+#define DRR_READ 20                       // ioctl: reads take the classes in deficit round robin by weight (param != 0)
+#define BUSY_POLL 21                      // ioctl: blocking operations spin for up to param microseconds before sleeping
+#define MAX_BUSY_POLL 10000               // largest busy-poll window (us)
+#define TIMEOUT_NS 22                     // ioctl: timeout of blocking operations in nanoseconds (ioctl 7 takes milliseconds)
+#define DEADLINE 23                       // ioctl: blocking operations give up at CLOCK_MONOTONIC param ns, 0 clears it
+#define DEADLINE_LEFT 24                  // ioctl: stores at param (__u64) the ns left before the deadline of the session (0 if past)
+#define BATCH 25                          // ioctl: runs the reads and writes of the batch at param, see batch.h
+#define SINGLE_FLOW 0                     // read modes of a session
+#define STRICT_PRIORITY 1
+#define DEFICIT_ROUND_ROBIN 2
 #define MIN(a,b) (((a)<(b))?(a):(b))
-#define AUDIT if (1)
+#define AUDIT if (static_branch_unlikely(&audit_key))
+// per-minor parameters and counters only exist for the first MINORS minors
+#define count_per_minor(counters, minor, n) do { if ((minor) < MINORS) __sync_add_and_fetch(&(counters)[minor], n); } while (0)
 
 #ifndef _INFOH_
 #define _INFOH_
 
+/*
+ * AUDIT logging is off by default and, being behind a static key, costs a
+ * patched out jump until it is switched on with the audit parameter, at load
+ * time or later through /sys/module/multi_flow/parameters/audit.
+ */
+static DEFINE_STATIC_KEY_FALSE(audit_key);
+static bool audit;
+static bool audit_ready;                        // the key can only be flipped once the module is live
+
+static void sync_audit(void) {
+   if (audit)
+      static_branch_enable(&audit_key);
+   else
+      static_branch_disable(&audit_key);
+}
+
+static int set_audit(const char *val, const struct kernel_param *kp) {
+
+   int ret;
+
+   ret = param_set_bool(val, kp);
+   if (ret == 0 && audit_ready)
+      sync_audit();
+
+   return ret;
+}
+
+static const struct kernel_param_ops audit_ops = {
+   .set = set_audit,
+   .get = param_get_bool,
+};
+module_param_cb(audit, &audit_ops, &audit, 0660);
+MODULE_PARM_DESC(audit, "Enables the AUDIT log messages (default 0). The data path is better observed " \
+"through the multi_flow tracepoints.");
+
+static int max_minors = MINORS;
+module_param(max_minors, int, 0440);
+MODULE_PARM_DESC(max_minors, "Number of minors of the device, up to 1048576 (default 128). The state of a minor " \
+"is only allocated on its first open and freed when its last session is closed with both flows empty; " \
+"the per-minor parameters below cover the first 128 minors, the others use the defaults.");
+
 static int disabled_device[MINORS];
 module_param_array(disabled_device, int, NULL, 0660);
 MODULE_PARM_DESC(disabled_device, "Parameter to enable or disable " \
 "the device file, in terms of a specific minor number. If it is disabled, " \
 "any attempt to open a session should fail (but already open sessions will still be managed).");
 
-static int hp_bytes[MINORS];
-module_param_array(hp_bytes, int, NULL, 0660);
-MODULE_PARM_DESC(hp_bytes, "Current number of bytes in the High Priority flow.");
+static int classes = 2;
+module_param(classes, int, 0440);
+MODULE_PARM_DESC(classes, "Number of priority classes (flows) of every minor, from 2 (the default: the low " \
+"and high priority flows) up to 8. A higher class number means a higher priority.");
 
-static int lp_bytes[MINORS];
-module_param_array(lp_bytes, int, NULL, 0660);
-MODULE_PARM_DESC(lp_bytes, "Current number of bytes in the Low Priority flow.");
-
-static int hp_threads[MINORS];
-module_param_array(hp_threads, int, NULL, 0660);
-MODULE_PARM_DESC(hp_threads, "Number of threads currently waiting for data along the High Priority flow.");
+// the highest class, selected by ioctl 4 and on open, synchronous by default
+static inline int high_class(void) {
+   return classes - 1;
+}
 
-static int lp_threads[MINORS];
-module_param_array(lp_threads, int, NULL, 0660);
-MODULE_PARM_DESC(lp_threads, "Number of threads currently waiting for data along the Low Priority flow.");
+static int class_deferred[DATA_FLOWS] = { 1 };
+module_param_array(class_deferred, int, NULL, 0440);
+MODULE_PARM_DESC(class_deferred, "Per class: if set, writes are made visible by the deferred work instead of " \
+"synchronously (default: only class 0, the low priority one).");
+
+static int class_weight[DATA_FLOWS] = { [0 ... DATA_FLOWS - 1] = 1 };
+module_param_array(class_weight, int, NULL, 0440);
+MODULE_PARM_DESC(class_weight, "Per class weight for DRR_READ sessions, which read a class for up to its weight " \
+"times 1024 bytes in each round (default 1).");
+
+static int split_locks[MINORS];
+module_param_array(split_locks, int, NULL, 0440);
+MODULE_PARM_DESC(split_locks, "Concurrency mode of both flows of a specific minor number, chosen at module load. " \
+"If set, readers and writers synchronize on separate head and tail locks (two-lock queue) " \
+"instead of a single mutex, so that they do not serialize with each other.");
+
+static int spsc[MINORS];
+module_param_array(spsc, int, NULL, 0440);
+MODULE_PARM_DESC(spsc, "Lock-free single producer/single consumer mode of both flows of a specific minor " \
+"number (which has to be in ring_mode), chosen at module load or later with the SPSC_MODE ioctl. " \
+"A second concurrent producer or consumer is rejected with -EBUSY.");
+
+static int datagram[MINORS];
+module_param_array(datagram, int, NULL, 0440);
+MODULE_PARM_DESC(datagram, "Datagram mode of both flows of a specific minor number (which must not be in ring_mode), " \
+"chosen at module load or later with the DATAGRAM_MODE ioctl. Each write is an atomic record and reads return " \
+"whole records.");
+
+static int capacity[MINORS];
+module_param_array(capacity, int, NULL, 0440);
+MODULE_PARM_DESC(capacity, "Bytes each flow of a specific minor number can hold, from one page (4096 bytes, the default, " \
+"used for 0) up to 64 MB. It can be changed later with the SET_CAPACITY ioctl.");
+
+static int ring_mode[MINORS];
+module_param_array(ring_mode, int, NULL, 0440);
+MODULE_PARM_DESC(ring_mode, "Storage mode of both flows of a specific minor number, chosen at module load. " \
+"If set, the flow is a preallocated byte ring instead of a linked list of data segments, so that " \
+"no allocation takes place on the read/write path.");
 
 
 typedef struct _data_segment
@@ -67,89 +177,291 @@ typedef struct _data_segment
         char *buffer;
         size_t actual_size;
         off_t  off;
+        int pool;                               // payload pool of the buffer, see pool.h.
         struct _data_segment *next;
-        struct _data_segment *previous;
         
 } data_segment;
 
 
+/*
+ * Control page shared (read-only) with the sessions that mmap a ring. Both
+ * counters grow monotonically: the bytes readable in place are
+ * produced - consumed, starting at offset consumed % size of the ring, which
+ * is mapped right after this page.
+ */
+typedef struct _flow_control
+{
+        __u64 produced;                         // bytes made visible to readers since module load.
+        __u64 consumed;                         // bytes drained by readers since module load.
+        __u32 size;                             // size of the ring.
+        __u32 data_offset;                      // offset of the ring within the mapping.
+
+} flow_control;
+
+
 typedef struct _object_state
 {
-        struct mutex operation_synchronizer;
-        data_segment *head;                     // head of the linked list of data segments.
-        data_segment *tail;                     // tail of the linked list of data segments.
-        int valid_bytes;
-        int pending_bytes;
-        wait_queue_head_t wq;
+        struct mutex operation_synchronizer;    // the only lock of the flow, or the consumer (head) one with split_locks.
+        struct mutex tail_synchronizer;         // producer (tail) lock, used only with split_locks.
+        int split_locks;
+        int spsc;                               // lock-free single producer/single consumer ring.
+        int datagram;                           // each segment is a record, read whole, SEGMENT_STORAGE only.
+        atomic_t producer_busy;                 // spsc mode: a producer is running.
+        atomic_t consumer_busy;                 // spsc mode: a consumer is running.
+        data_segment *head;                     // dummy segment preceding the first one holding data.
+        data_segment *tail;                     // last segment of the flow (the dummy one if empty).
+        atomic_t valid_bytes;
+        atomic_t pending_bytes;
+        wait_queue_head_t readers;              // blocked readers, waiting exclusively.
+        wait_queue_head_t writers;              // blocked writers, waiting exclusively.
+        int capacity;                           // bytes the flow can hold.
+        int storage;                            // SEGMENT_STORAGE (linked list) or RING_STORAGE (byte ring).
+        flow_control *control;                  // control page followed by the ring, RING_STORAGE only.
+        atomic_t mappings;                      // live mmaps of the ring, -1 while it is being resized.
+        int resizing;                           // writers find no room while set_capacity changes the flow.
+        char *ring;                             // preallocated byte ring, RING_STORAGE only.
+        size_t ring_head;                       // offset of the first readable byte in the ring.
+        size_t ring_tail;                       // offset of the first free byte in the ring.
+        data_segment *pending_head;             // segments waiting for the deferred work, linked through next.
+        data_segment *pending_tail;
+        int pending_segments;                   // length of the pending list.
+        struct _write_completion *completions_head;     // asynchronous writes waiting for the deferred work, see write.h.
+        struct _write_completion *completions_tail;
+        struct list_head pending_sessions;      // sessions with deferred writes waiting for the deferred work.
+        struct work_struct deferred_work;       // drains the pending list (or pending ring bytes).
+        u64 pending_since;                      // when the oldest write still pending was queued (ns).
+        int minor;
+        int priority;                           // class of the flow (index in flows of its minor_state).
+        int deferred;                           // writes go through the deferred work, see class_deferred.
+        int weight;                             // quanta per round for DRR_READ sessions.
+        atomic_t waiting;                       // threads blocked on the flow.
+        struct _flow_stats __percpu *stats;     // see stats.h.
 
 } object_state;
 
 
+// sequence numbers of the deferred writes of a session on one class
+typedef struct _write_sequence
+{
+        atomic64_t sequence;                    // deferred writes handed to the deferred work.
+        atomic64_t committed;                   // deferred writes made visible, all of them up to this number.
+        struct list_head pending_link;          // in pending_sessions of the flow, while some are pending.
+        struct _session *session;
+
+} write_sequence;
+
+
+// when the blocking operations of a session give up, see budget_deadline
+typedef struct _wait_budget
+{
+        u64 timeout;                            // from the start of each operation (ns).
+        u64 deadline;                           // absolute, CLOCK_MONOTONIC (ns): when set, it replaces timeout.
+
+} wait_budget;
+
+
+// adaptive busy-poll window of a session, see spin_flow
+typedef struct _busy_poll
+{
+        u64 limit;                              // most time a blocking operation spins before sleeping (ns), 0 never.
+        u64 average;                            // moving average of the waits of the session (ns).
+
+} busy_poll;
+
+
 typedef struct _session
 {
-        int priority;                           // priority level (high or low) for the operations
+        int priority;                           // class of the flow for the operations (low or high priority by default)
         int blocking;                           // blocking vs non-blocking read and write operations
-        unsigned long timeout;                  // setup of a timeout regulating the awake of blocking operations
+        wait_budget budget;                     // setup of a timeout regulating the awake of blocking operations
+        int iovec_segments;                     // writev() appends one segment per iovec instead of one per call
+        int stream;                             // write() packs small writes into the last segment, see STREAM_MODE
+        int read_mode;                          // SINGLE_FLOW, or the classes read by COMBINED_READ and DRR_READ
+        int drr_class;                          // DRR_READ: class whose turn it is.
+        int deficit[DATA_FLOWS];                // DRR_READ: bytes each class may still be read for in this round.
+        write_sequence sequences[DATA_FLOWS];   // per class, see WRITE_SEQUENCE.
+        busy_poll poll;                         // see BUSY_POLL.
+        struct eventfd_ctx *eventfd;            // signaled on each commit, see BIND_EVENTFD.
+        struct _minor_state *device;            // state of the minor, held as long as the session is open.
 
 } session;
 
 
-object_state objects[MINORS][DATA_FLOWS];
+typedef struct _minor_state
+{
+        object_state flows[DATA_FLOWS];         // indexed by class, the first classes ones only.
+        atomic_t sessions;                      // sessions currently open on the minor.
 
+} minor_state;
 
 
-int writable_bytes( object_state *the_object, int priority ) {
-   if (priority == HIGH_PRIORITY)
-      return OBJECT_MAX_SIZE - (the_object -> valid_bytes);
+/*
+ * State of the minors opened at least once, indexed by minor number, see
+ * minors.h. Lookups and updates of the array, and changes of the sessions
+ * counters, happen under minors_lock.
+ */
+static DEFINE_XARRAY(minors);
+static DEFINE_MUTEX(minors_lock);
+
+
+
+int writable_bytes( object_state *the_object ) {
+   if (unlikely(READ_ONCE(the_object -> resizing)))
+      return 0;
+   if (!the_object -> deferred)
+      return READ_ONCE(the_object -> capacity) - atomic_read_acquire(&(the_object -> valid_bytes));
    else
-      return OBJECT_MAX_SIZE - (the_object -> valid_bytes) - (the_object -> pending_bytes);
+      return READ_ONCE(the_object -> capacity) - atomic_read_acquire(&(the_object -> valid_bytes)) - atomic_read(&(the_object -> pending_bytes));
+}
+
+
+/*
+ * With split_locks writers (and the deferred work) only take the tail lock and
+ * readers only the head one, so that the two sides proceed in parallel; they
+ * share nothing but the atomic byte counters and, when the flow is empty, the
+ * next field of the dummy segment.
+ */
+struct mutex *producer_mutex( object_state *the_object ) {
+   return the_object -> split_locks ? &(the_object -> tail_synchronizer) : &(the_object -> operation_synchronizer);
+}
+
+
+struct mutex *consumer_mutex( object_state *the_object ) {
+   return &(the_object -> operation_synchronizer);
 }
 
 
-int check_if_writable_and_try_lock(object_state *the_object, int priority) {
-   if(mutex_trylock(&(the_object -> operation_synchronizer))) {
-      if(writable_bytes(the_object, priority) == 0) {
-            mutex_unlock(&(the_object -> operation_synchronizer));
+/*
+ * In spsc mode the only producer and the only consumer of a ring flow run
+ * without any lock, ordered by the atomic counters alone. The busy flags just
+ * turn a second concurrent producer (or consumer) away with -EBUSY instead of
+ * letting it corrupt the ring.
+ *
+ * The mode is switched (see set_spsc) holding both the mutex and the flag, so
+ * whoever gets one of them checks the mode again and, if it changed in the
+ * meanwhile, releases it and goes for the other one.
+ */
+int flow_trylock(object_state *the_object, struct mutex *mutex, atomic_t *busy) {
+   for (;;) {
+      if (READ_ONCE(the_object -> spsc)) {
+         if (atomic_cmpxchg(busy, 0, 1) != 0)
             return 0;
+         if (likely(READ_ONCE(the_object -> spsc)))
+            return 1;
+         atomic_set_release(busy, 0);
+      } else {
+         if (!mutex_trylock(mutex))
+            return 0;
+         if (likely(!READ_ONCE(the_object -> spsc)))
+            return 1;
+         mutex_unlock(mutex);
+      }
+   }
+}
+
+
+// 0 when acquired, -ERESTARTSYS on signals, -EBUSY for a second spsc producer/consumer
+int flow_lock_interruptible(object_state *the_object, struct mutex *mutex, atomic_t *busy) {
+   for (;;) {
+      if (READ_ONCE(the_object -> spsc)) {
+         if (atomic_cmpxchg(busy, 0, 1) != 0)
+            return -EBUSY;
+         if (likely(READ_ONCE(the_object -> spsc)))
+            return 0;
+         atomic_set_release(busy, 0);
+      } else {
+         if (mutex_lock_interruptible(mutex))
+            return -ERESTARTSYS;
+         if (likely(!READ_ONCE(the_object -> spsc)))
+            return 0;
+         mutex_unlock(mutex);
       }
-      return 1;
    }
-   return 0;
 }
 
 
-int check_if_readable_and_try_lock(object_state *the_object) {
-        if (mutex_trylock(&(the_object->operation_synchronizer))) {
-                if(the_object->valid_bytes == 0) {
-                        mutex_unlock(&(the_object->operation_synchronizer));
-                        return 0;
-                }
-                return 1;
-        }
-        return 0;
+void flow_unlock(object_state *the_object, struct mutex *mutex, atomic_t *busy) {
+   if (the_object -> spsc)
+      atomic_set_release(busy, 0);
+   else
+      mutex_unlock(mutex);
 }
 
-void inc_pending_threads( int minor, int priority ) {
-   if (priority == HIGH_PRIORITY)
-      __sync_add_and_fetch(&hp_threads[minor], 1);
-   else 
-      __sync_add_and_fetch(&lp_threads[minor], 1);
+
+int producer_trylock(object_state *the_object) {
+   return flow_trylock(the_object, producer_mutex(the_object), &(the_object -> producer_busy));
+}
+
+
+int producer_lock_interruptible(object_state *the_object) {
+   return flow_lock_interruptible(the_object, producer_mutex(the_object), &(the_object -> producer_busy));
+}
+
+
+void producer_unlock(object_state *the_object) {
+   flow_unlock(the_object, producer_mutex(the_object), &(the_object -> producer_busy));
+}
+
+
+int consumer_trylock(object_state *the_object) {
+   return flow_trylock(the_object, consumer_mutex(the_object), &(the_object -> consumer_busy));
+}
+
+
+int consumer_lock_interruptible(object_state *the_object) {
+   return flow_lock_interruptible(the_object, consumer_mutex(the_object), &(the_object -> consumer_busy));
+}
+
+
+void consumer_unlock(object_state *the_object) {
+   flow_unlock(the_object, consumer_mutex(the_object), &(the_object -> consumer_busy));
+}
+
+
+/*
+ * Each wakeup resumes at most one blocked reader (or writer) and every epoll
+ * waiter of that direction; the poll key tells epoll whether the flow became
+ * readable or writable.
+ */
+void wake_up_readers(object_state *the_object) {
+   wake_up_interruptible_poll(&(the_object -> readers), EPOLLIN | EPOLLRDNORM);
+}
+
+
+void wake_up_writers(object_state *the_object) {
+   wake_up_interruptible_poll(&(the_object -> writers), EPOLLOUT | EPOLLWRNORM);
+}
+
+
+// room has been freed; the next reader is resumed only if bytes are left for it
+void wake_up_after_read(object_state *the_object) {
+   if (the_object -> spsc)
+      return;              // done by ring_consume on the full -> non-full transition
+   wake_up_writers(the_object);
+   if (atomic_read(&(the_object -> valid_bytes)) > 0)
+      wake_up_readers(the_object);
+}
+
+
+// bytes have been appended (or reserved); the next writer is resumed only if room is left for it
+void wake_up_after_write(object_state *the_object) {
+   if (the_object -> spsc)
+      return;              // done by ring_commit on the empty -> non-empty transition
+   // deferred bytes only become readable with the deferred run, which wakes the readers itself
+   if (!the_object -> deferred)
+      wake_up_readers(the_object);
+   if (writable_bytes(the_object) > 0)
+      wake_up_writers(the_object);
 }
 
 
-void dec_pending_threads( int minor, int priority ) {
-   if (priority == HIGH_PRIORITY)
-      __sync_add_and_fetch(&hp_threads[minor], -1);
-   else 
-      __sync_add_and_fetch(&lp_threads[minor], -1);
+void inc_pending_threads( object_state *the_object ) {
+   atomic_inc(&(the_object -> waiting));
 }
 
 
-ssize_t free_data_segment( data_segment *segment, ssize_t error ) {
-   if (likely(segment -> buffer != NULL))
-            kfree(segment -> buffer);
-   kfree(segment);
-   return -error;
+void dec_pending_threads( object_state *the_object ) {
+   atomic_dec(&(the_object -> waiting));
 }
 
 
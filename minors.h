@@ -0,0 +1,202 @@
+#include "info.h"
+#include "ring.h"
+#include "pool.h"
+#include "write.h"
+#include "stats.h"
+
+#ifndef _MINORSH_
+#define _MINORSH_
+
+/*
+ * The state of a minor (a flow per class) is allocated on its first open and
+ * stored in the minors xarray, so that loading the module costs nothing and
+ * memory follows the minors actually in use. It is freed when its last
+ * session is closed with both flows empty and unmapped; a minor closed with
+ * bytes still in it keeps them for the next session.
+ */
+
+minor_state *alloc_minor_state(int);
+void release_minor_state(minor_state *);
+minor_state *get_minor_state(int);
+minor_state *find_minor_state(int);
+void put_minor_state(minor_state *);
+void destroy_minors(void);
+
+
+static void release_flow(object_state *the_object) {
+   free_segment_chain(the_object -> head);
+   free_segment_chain(the_object -> pending_head);
+   ring_free(the_object);
+   free_stats(the_object);
+}
+
+
+// the flows are set up from the per-minor parameters, or the defaults past MINORS
+minor_state *alloc_minor_state(int minor) {
+
+   minor_state *state;
+   object_state *the_object;
+   int j;
+
+   state = kzalloc(sizeof(minor_state), GFP_KERNEL);
+   if (state == NULL)
+      return NULL;
+
+   for (j = 0; j < classes; j++) {
+      the_object = &(state -> flows[j]);
+
+      mutex_init(&(the_object -> operation_synchronizer));
+      mutex_init(&(the_object -> tail_synchronizer));
+      the_object -> split_locks = (minor < MINORS) ? split_locks[minor] : 0;
+
+      the_object -> head = alloc_dummy_segment();
+      if (the_object -> head == NULL)
+         goto revert_allocation;
+      the_object -> tail = the_object -> head;
+
+      init_waitqueue_head(&(the_object -> readers));
+      init_waitqueue_head(&(the_object -> writers));
+
+      the_object -> minor = minor;
+      the_object -> priority = j;
+      the_object -> deferred = class_deferred[j];
+      the_object -> weight = class_weight[j];
+      if (alloc_stats(the_object) != 0)
+         goto revert_allocation;
+      INIT_WORK(&(the_object -> deferred_work), deferred_write);
+      INIT_LIST_HEAD(&(the_object -> pending_sessions));
+
+      the_object -> capacity = (minor < MINORS) ? capacity[minor] : OBJECT_MAX_SIZE;
+      the_object -> storage = (minor < MINORS && ring_mode[minor]) ? RING_STORAGE : SEGMENT_STORAGE;
+      if (the_object -> storage == RING_STORAGE && ring_alloc(the_object) != 0)
+         goto revert_allocation;
+
+      // spsc mode relies on the ring, segment flows ignore it
+      the_object -> spsc = minor < MINORS && spsc[minor] && the_object -> storage == RING_STORAGE;
+      // and datagram mode on segments, rings ignore it
+      the_object -> datagram = minor < MINORS && datagram[minor] && the_object -> storage == SEGMENT_STORAGE;
+   }
+
+   return state;
+
+revert_allocation:
+   printk("%s: unable to allocate the state of minor %d\n", MODNAME, minor);
+   for (; j >= 0; j--)
+      release_flow(&(state -> flows[j]));
+   kfree(state);
+   return NULL;
+}
+
+
+// no deferred run may be in progress on the flows
+void release_minor_state(minor_state *state) {
+
+   int j;
+
+   for (j = 0; j < classes; j++)
+      release_flow(&(state -> flows[j]));
+   kfree(state);
+}
+
+
+// the state of minor with one more session, ERR_PTR on failure
+minor_state *get_minor_state(int minor) {
+
+   minor_state *state;
+   int ret;
+
+   mutex_lock(&minors_lock);
+
+   state = xa_load(&minors, minor);
+   if (state == NULL) {
+      state = alloc_minor_state(minor);
+      if (state == NULL) {
+         mutex_unlock(&minors_lock);
+         return ERR_PTR(-ENOMEM);
+      }
+      ret = xa_err(xa_store(&minors, minor, state, GFP_KERNEL));
+      if (ret != 0) {
+         mutex_unlock(&minors_lock);
+         release_minor_state(state);
+         return ERR_PTR(ret);
+      }
+   }
+   atomic_inc(&(state -> sessions));
+
+   mutex_unlock(&minors_lock);
+
+   return state;
+}
+
+
+// as get_minor_state, but NULL if the minor has no state rather than allocating one
+minor_state *find_minor_state(int minor) {
+
+   minor_state *state;
+
+   mutex_lock(&minors_lock);
+   state = xa_load(&minors, minor);
+   if (state != NULL)
+      atomic_inc(&(state -> sessions));
+   mutex_unlock(&minors_lock);
+
+   return state;
+}
+
+
+static int minor_idle(minor_state *state) {
+
+   int j;
+   object_state *the_object;
+
+   for (j = 0; j < classes; j++) {
+      the_object = &(state -> flows[j]);
+      if (atomic_read(&(the_object -> valid_bytes)) != 0 || atomic_read(&(the_object -> pending_bytes)) != 0 ||
+            atomic_read(&(the_object -> mappings)) != 0)
+         return 0;
+   }
+
+   return 1;
+}
+
+
+void put_minor_state(minor_state *state) {
+
+   int j, minor = state -> flows[0].minor;
+
+   mutex_lock(&minors_lock);
+
+   if (!atomic_dec_and_test(&(state -> sessions))) {
+      mutex_unlock(&minors_lock);
+      return;
+   }
+
+   // with no session left nothing can queue work, only a run already queued may be in progress
+   for (j = 0; j < classes; j++)
+      flush_work(&(state -> flows[j].deferred_work));
+
+   if (!minor_idle(state)) {
+      mutex_unlock(&minors_lock);
+      return;
+   }
+
+   xa_erase(&minors, minor);
+   mutex_unlock(&minors_lock);
+
+   release_minor_state(state);
+}
+
+
+// at unload, when no session is left and the deferred work is gone
+void destroy_minors(void) {
+
+   unsigned long minor;
+   minor_state *state;
+
+   xa_for_each(&minors, minor, state)
+      release_minor_state(state);
+   xa_destroy(&minors);
+}
+
+
+#endif
@@ -1,11 +1,17 @@
 #include "info.h"
-#include "read.h"
-#include "write.h"
+#define CREATE_TRACE_POINTS
+#include "multi_flow_trace.h"
+#undef CREATE_TRACE_POINTS
+#include "flow.h"
+#include "minors.h"
+#include "batch.h"
 
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static __poll_t dev_poll(struct file *, poll_table *);
 
 static int Major; /* Major number assigned to char device driver */
 
@@ -17,21 +23,25 @@ static int Major; /* Major number assigned to char device driver */
 #define get_minor(session) MINOR(session->f_dentry->d_inode->i_rdev)
 #endif
 
+// flow selected by the session
+#define session_flow(session) (&((session) -> device -> flows[(session) -> priority]))
+
 
 static int dev_open(struct inode *inode, struct file *file) {
 
    session *session;
-   int minor = get_minor(file);
+   minor_state *state;
+   int i, minor = get_minor(file);
    
-   if (minor >= MINORS) return -ENODEV;
+   if (minor >= max_minors) return -ENODEV;
 
-   if(disabled_device[minor]){
+   if(minor < MINORS && disabled_device[minor]){
 
       AUDIT printk("%s: dev with [minor] number [%d] disabled\n", MODNAME, minor);
       return -ENOENT;
    }
 
-   session = kzalloc(sizeof(session), GFP_ATOMIC);
+   session = kzalloc(sizeof(*session), GFP_ATOMIC);
    AUDIT printk("%s: allocated new session\n", MODNAME);
    if (session == NULL)
    {
@@ -39,10 +49,29 @@ static int dev_open(struct inode *inode, struct file *file) {
       return -ENOMEM;
    }
 
-   session->priority = HIGH_PRIORITY;
+   state = get_minor_state(minor);
+   if (IS_ERR(state))
+   {
+      kfree(session);
+      return PTR_ERR(state);
+   }
+
+   session->priority = high_class();
    session->blocking = NON_BLOCKING;
-   session->timeout = 0;
+   session->budget.timeout = 0;
+   session->budget.deadline = 0;
+   session->iovec_segments = 0;
+   session->stream = 0;
+   session->read_mode = SINGLE_FLOW;
+   session->poll.limit = 0;
+   session->poll.average = 0;
+   for (i = 0; i < DATA_FLOWS; i++) {
+      INIT_LIST_HEAD(&session->sequences[i].pending_link);
+      session->sequences[i].session = session;
+   }
+   session->device = state;
    file->private_data = session;
+   trace_multi_flow_open(minor, atomic_read(&state->sessions));
 
    AUDIT printk("%s: device file successfully opened for object with minor %d\n", MODNAME, minor);
    
@@ -53,6 +82,16 @@ static int dev_open(struct inode *inode, struct file *file) {
 static int dev_release(struct inode *inode, struct file *file) {
 
    session *session = file->private_data;
+   int i;
+
+   // the deferred runs committing the last writes of the session still refer to it
+   for (i = 0; i < classes; i++)
+      if (atomic64_read(&session->sequences[i].sequence) != 0)
+         flush_work(&session->device->flows[i].deferred_work);
+   if (session->eventfd != NULL)
+      eventfd_ctx_put(session->eventfd);
+
+   put_minor_state(session->device);
    kfree(session);
 
    AUDIT printk("%s: device file closed\n", MODNAME);
@@ -63,154 +102,263 @@ static int dev_release(struct inode *inode, struct file *file) {
 
 static ssize_t dev_write(struct file *filp, const char __user *buff, size_t len, loff_t *off) {
 
-   int ret, res, priority, blocking, minor, major;
-   gfp_t flags;
-   data_segment *new_segment;
-   object_state *current_stream_state;
-   session *session;
+   session *session = filp -> private_data;
 
-   minor = get_minor(filp);
-   major = get_major(filp);
-   
-   session = filp -> private_data;
-   priority = session -> priority;
-   blocking = session -> blocking;
+   return write_flow(session_flow(session), session, buff, len, get_major(filp));
+}
 
-   current_stream_state = &objects[minor][priority];
 
-   if (unlikely(len == 0))
-            return 0;
+/*
+ * writev()/pwritev2() entry point: all the iovecs are appended under a single
+ * acquisition of the lock, as one segment or as one segment per iovec
+ * depending on the session (SEGMENT_PER_IOVEC). RWF_NOWAIT makes the call
+ * non-blocking whatever the session says. Low priority writes submitted
+ * through io_uring or AIO complete when the deferred work makes them visible.
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
 
-   flags = (blocking == BLOCKING) ? GFP_KERNEL : GFP_ATOMIC;
+   session *session = iocb -> ki_filp -> private_data;
+   int blocking = (iocb -> ki_flags & IOCB_NOWAIT) ? NON_BLOCKING : session -> blocking;
 
-   new_segment = (data_segment *) kzalloc(sizeof(data_segment), flags);
-   if (unlikely(new_segment == NULL))
-            return -ENOMEM;
+   return write_iter_flow(session_flow(session), session, blocking, from, is_sync_kiocb(iocb) ? NULL : iocb,
+      get_major(iocb -> ki_filp));
+}
 
-   new_segment -> buffer = (char *) kzalloc(len, flags);
-   if (unlikely(new_segment -> buffer == NULL))
-            return free_data_segment(new_segment, ENOMEM);
 
-   res = copy_from_user(new_segment -> buffer, buff, len);
-   
-   if (unlikely(res == len))
-            return free_data_segment(new_segment, ENOMEM);
+static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off) {
 
-   if(blocking == BLOCKING) {
-      
-      AUDIT printk("%s current thread is going to wait for space available for writing on device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME, major, minor);
+   session *session = filp -> private_data;
 
-      inc_pending_threads(minor,priority);
-      ret = wait_event_interruptible_timeout(
-                     current_stream_state -> wq,
-                     check_if_writable_and_try_lock(current_stream_state, priority),
-                     msecs_to_jiffies(session -> timeout)
-               );
-      dec_pending_threads(minor,priority);
+   if (session -> read_mode != SINGLE_FLOW)
+      return read_flows(session -> device -> flows, session, session -> blocking, buff, len, NULL, get_major(filp));
 
-      AUDIT printk("%s current thread has waken up from wait queue related to device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME, major, minor);
+   return read_flow(session_flow(session), session, buff, len, get_major(filp));
+}
 
-      if(ret == 0) {
-         AUDIT printk("%s timer has expired for current thread and cannot write on device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME, major, minor);
 
-         return free_data_segment(new_segment, ETIME);
+/*
+ * readv()/preadv2() entry point: the iovecs are filled in FIFO order under a
+ * single acquisition of the lock (one per flow read, with COMBINED_READ or DRR_READ).
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
-      } else if(ret == -ERESTARTSYS) {
-         AUDIT printk("%s current thread received a signal while waiting for space on device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME, major, minor);
+   session *session = iocb -> ki_filp -> private_data;
+   int blocking = (iocb -> ki_flags & IOCB_NOWAIT) ? NON_BLOCKING : session -> blocking;
 
-         return free_data_segment(new_segment, EINTR);
-      }
-   } else {
-            if (!mutex_trylock(&(current_stream_state -> operation_synchronizer)))
-                     return free_data_segment(new_segment, EBUSY)                   ;
+   if (session -> read_mode != SINGLE_FLOW)
+      return read_flows(session -> device -> flows, session, blocking, NULL, 0, to, get_major(iocb -> ki_filp));
 
-            if (unlikely(writable_bytes(current_stream_state, priority) == 0)) {
-                     mutex_unlock(&(current_stream_state -> operation_synchronizer));
-                     return free_data_segment(new_segment, EAGAIN);
-            }
+   return read_iter_flow(session_flow(session), session, blocking, to, get_major(iocb -> ki_filp));
+}
+
+
+
+/*
+ * Binds the eventfd behind fd to the session, or unbinds it for a negative
+ * fd. The deferred runs signal it holding the producer lock of their flow,
+ * so the old one is put only once every deferred flow has been locked after
+ * the swap.
+ */
+static int bind_eventfd(session *session, int fd) {
+
+   struct eventfd_ctx *eventfd = NULL, *old;
+   object_state *current_stream_state;
+   int i;
+
+   if (fd >= 0) {
+      eventfd = eventfd_ctx_fdget(fd);
+      if (IS_ERR(eventfd))
+         return PTR_ERR(eventfd);
    }
 
-   new_segment-> actual_size = MIN(len - res, writable_bytes(current_stream_state, priority));
+   old = xchg(&session->eventfd, eventfd);
 
-   if (priority == HIGH_PRIORITY) {
-            ret = write( new_segment, current_stream_state );
-   } else {
-            if ((ret = put_work(current_stream_state, new_segment, major, minor, flags)) < 0) {
-                     mutex_unlock(&(current_stream_state->operation_synchronizer));
-                     // It gives the possibility to other threads to try to write
-                     wake_up_interruptible(&(current_stream_state -> wq));
-                     return free_data_segment(new_segment, -ret);
-            }
+   for (i = 0; i < classes; i++) {
+      current_stream_state = &session->device->flows[i];
+      if (!current_stream_state->deferred)
+         continue;
+      mutex_lock(producer_mutex(current_stream_state));
+      mutex_unlock(producer_mutex(current_stream_state));
+   }
+
+   if (old != NULL)
+      eventfd_ctx_put(old);
+
+   return 0;
+}
+
+
+
+/*
+ * Switches every flow of a minor to (or from) spsc mode. Every lock of the
+ * flows is taken, so no operation can be in progress, and pending deferred
+ * writes are drained first since spsc rings commit synchronously.
+ */
+static int set_spsc(minor_state *state, int enable) {
+
+   int i, ret = 0, minor = state->flows[0].minor;
+   object_state *current_stream_state;
+
+   for (i = 0; i < classes; i++) {
+      current_stream_state = &state->flows[i];
+      if (current_stream_state->storage != RING_STORAGE)
+         return -EINVAL;
+      flush_work(&(current_stream_state->deferred_work));
+   }
+
+   for (i = 0; i < classes; i++) {
+      current_stream_state = &state->flows[i];
+
+      mutex_lock(&(current_stream_state->operation_synchronizer));
+      mutex_lock(&(current_stream_state->tail_synchronizer));
+
+      if (atomic_read(&(current_stream_state->pending_bytes)) != 0) {
+         ret = -EBUSY;
+      } else if (atomic_cmpxchg(&(current_stream_state->producer_busy), 0, 1) == 0) {
+         if (atomic_cmpxchg(&(current_stream_state->consumer_busy), 0, 1) == 0) {
+            WRITE_ONCE(current_stream_state->spsc, enable);
+            atomic_set_release(&(current_stream_state->consumer_busy), 0);
+         } else {
+            ret = -EBUSY;
+         }
+         atomic_set_release(&(current_stream_state->producer_busy), 0);
+      } else {
+         ret = -EBUSY;
+      }
+
+      mutex_unlock(&(current_stream_state->tail_synchronizer));
+      mutex_unlock(&(current_stream_state->operation_synchronizer));
+
+      if (ret != 0)
+         break;
+   }
+
+   // threads sleeping in the old mode must look at the flows again
+   for (i = 0; i < classes; i++) {
+      wake_up_interruptible(&(state->flows[i].readers));
+      wake_up_interruptible(&(state->flows[i].writers));
    }
 
-   mutex_unlock(&(current_stream_state -> operation_synchronizer));
-   wake_up_interruptible(&(current_stream_state -> wq));
+   // a state freed when idle is rebuilt from the parameters
+   if (ret == 0 && minor < MINORS)
+      spsc[minor] = enable;
 
    return ret;
 }
 
 
-static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off) {
-   
-   int ret, priority, blocking, major, minor;
+/*
+ * Switches every flow of a minor to (or from) datagram mode. Only empty
+ * flows are switched, so that the segments of a byte stream (partly read, or
+ * packed by stream writes) are never taken for records.
+ */
+static int set_datagram(minor_state *state, int enable) {
+
+   int i, ret = 0, minor = state->flows[0].minor;
    object_state *current_stream_state;
-   session *session;
-   
-   minor = get_minor(filp);
-   major = get_major(filp);
-   
-   session = filp -> private_data;
-   priority = session -> priority;
-   blocking = session -> blocking;
 
-   current_stream_state = &objects[minor][priority];
+   for (i = 0; i < classes; i++) {
+      current_stream_state = &state->flows[i];
+      if (current_stream_state->storage != SEGMENT_STORAGE)
+         return -EINVAL;
+      flush_work(&(current_stream_state->deferred_work));
+   }
 
-   AUDIT printk("%s current thread has called a read on %s device [MAJOR: %d, minor: %d]",
-         MODNAME, DEVICE_NAME ,major, minor);
+   for (i = 0; i < classes && ret == 0; i++) {
+      current_stream_state = &state->flows[i];
 
-   if (unlikely(len == 0))
-            return 0;
+      mutex_lock(&(current_stream_state->operation_synchronizer));
+      mutex_lock(&(current_stream_state->tail_synchronizer));
 
-   if (blocking == BLOCKING) {
+      if (atomic_read(&(current_stream_state->valid_bytes)) != 0 || atomic_read(&(current_stream_state->pending_bytes)) != 0)
+         ret = -EBUSY;
+      else
+         WRITE_ONCE(current_stream_state->datagram, enable);
 
-      AUDIT printk("%s current thread is waiting for bytes to read from device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME , major, minor);
+      mutex_unlock(&(current_stream_state->tail_synchronizer));
+      mutex_unlock(&(current_stream_state->operation_synchronizer));
+   }
+
+   // a state freed when idle is rebuilt from the parameters
+   if (ret == 0 && minor < MINORS)
+      datagram[minor] = enable;
 
-      inc_pending_threads(minor,priority);
-      ret = wait_event_interruptible_timeout(
-                     current_stream_state -> wq,
-                     check_if_readable_and_try_lock(current_stream_state),
-                     msecs_to_jiffies(session -> timeout)
-            );
-      dec_pending_threads(minor,priority);
+   return ret;
+}
 
-      AUDIT printk("%s current thread has woken up from wait queue related to device %s [MAJOR: %d, minor: %d]",
-         MODNAME, DEVICE_NAME , major, minor);
 
-      if(ret == 0) {
-         AUDIT printk("%s timer has expired for current thread and it is not possible to read from device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME, major, minor);
 
-         return -ETIME;
-      } else if(ret == -ERESTARTSYS) {
-         AUDIT printk("%s current thread was hit with a signal while waiting for bytes to read on device %s [MAJOR: %d, minor: %d]",
-            MODNAME, DEVICE_NAME, major, minor);
+/*
+ * Resizes every flow of a minor, all of them or none. Writers are kept out
+ * of the flows by their resizing flag, not by their locks, so readers carry
+ * on meanwhile: segment flows just get a new limit, rings are moved to a new
+ * area allocated beforehand (see ring_resize). Flows holding more bytes than
+ * the new capacity, spsc rings (which have no lock to keep the two sides
+ * out) and mapped rings are refused with -EBUSY.
+ */
+static int set_capacity(minor_state *state, int new_capacity) {
 
-         return -EINTR;
+   int i, flagged = 0, ret = 0, minor = state->flows[0].minor;
+   object_state *current_stream_state;
+   flow_control *controls[DATA_FLOWS] = { NULL };
+
+   // first every ring is pinned unmapped and gets its new area
+   for (i = 0; i < classes && ret == 0; i++) {
+      current_stream_state = &state->flows[i];
+      if (current_stream_state->spsc) {
+         ret = -EBUSY;
+      } else if (current_stream_state->storage == RING_STORAGE) {
+         if (atomic_cmpxchg(&(current_stream_state->mappings), 0, -1) != 0) {
+            ret = -EBUSY;
+         } else {
+            controls[i] = ring_area_alloc(new_capacity);
+            if (controls[i] == NULL) {
+               atomic_set(&(current_stream_state->mappings), 0);
+               ret = -ENOMEM;
+            }
+         }
       }
-   } else {
-      if (!mutex_trylock( &(current_stream_state -> operation_synchronizer) ))
-         return -EBUSY;
    }
 
-   ret = read(current_stream_state, buff, len);
+   // then writers are stopped, and every flow must fit before any is changed: readers only drain bytes
+   for (; flagged < classes && ret == 0; flagged++) {
+      current_stream_state = &state->flows[flagged];
+      mutex_lock(producer_mutex(current_stream_state));
+      WRITE_ONCE(current_stream_state->resizing, 1);
+      if (atomic_read(&(current_stream_state->valid_bytes)) + atomic_read(&(current_stream_state->pending_bytes)) > new_capacity)
+         ret = -EBUSY;
+      mutex_unlock(producer_mutex(current_stream_state));
+   }
 
-   mutex_unlock(&(current_stream_state->operation_synchronizer));
-   wake_up_interruptible(&(current_stream_state->wq));
+   for (i = 0; i < classes && ret == 0; i++) {
+      current_stream_state = &state->flows[i];
+      if (controls[i] != NULL) {
+         ring_resize(current_stream_state, &controls[i], new_capacity);
+      } else {
+         mutex_lock(producer_mutex(current_stream_state));
+         WRITE_ONCE(current_stream_state->capacity, new_capacity);
+         mutex_unlock(producer_mutex(current_stream_state));
+      }
+   }
+
+   for (i = 0; i < classes; i++) {
+      current_stream_state = &state->flows[i];
+
+      // the old ring, or the new one if it was not needed
+      if (controls[i] != NULL) {
+         vfree(controls[i]);
+         atomic_set(&(current_stream_state->mappings), 0);
+      }
+
+      // writers stopped by the flag wait for room that is there again, resized or not
+      if (i < flagged) {
+         WRITE_ONCE(current_stream_state->resizing, 0);
+         wake_up_writers(current_stream_state);
+      }
+   }
+
+   if (ret == 0 && minor < MINORS)
+      capacity[minor] = new_capacity;
 
    return ret;
 }
@@ -220,6 +368,8 @@ static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off)
 static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param) {
 
    session *session;
+   object_state *current_stream_state;
+   int ret;
    session = filp->private_data;
 
    switch (command)
@@ -230,7 +380,7 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
       "[major,minor] number [%d,%d] and command %u \n", MODNAME, get_major(filp), get_minor(filp), command);
       break;
    case 4:
-      session->priority = HIGH_PRIORITY;
+      session->priority = high_class();
       AUDIT printk("%s: somebody has set priority level to HIGH on dev with " \
       "[major,minor] number [%d,%d] and command %u \n", MODNAME, get_major(filp), get_minor(filp), command);
       break;
@@ -245,10 +395,139 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
       "[major,minor] number [%d,%d] and command %u \n", MODNAME, get_major(filp), get_minor(filp), command);
       break;
    case 7:
-      session->timeout = param;
+      // no longer rounded to jiffies: the wait runs on a high resolution timer
+      WRITE_ONCE(session->budget.timeout, (param > KTIME_MAX / NSEC_PER_MSEC) ? KTIME_MAX : param * NSEC_PER_MSEC);
       AUDIT printk("%s: somebody has set TIMEOUT on dev with " \
       "[major,minor] number [%d,%d] and command %u \n", MODNAME, get_major(filp), get_minor(filp), command);
       break;
+   case SEGMENT_PER_IOVEC:
+      session->iovec_segments = (param != 0);
+      AUDIT printk("%s: somebody has set SEGMENT_PER_IOVEC to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case SET_CLASS:
+      if (param >= classes)
+         return -EINVAL;
+      session->priority = param;
+      AUDIT printk("%s: somebody has set CLASS to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case COMBINED_READ:
+      session->read_mode = (param != 0) ? STRICT_PRIORITY : SINGLE_FLOW;
+      AUDIT printk("%s: somebody has set COMBINED_READ to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case TIMEOUT_NS:
+      WRITE_ONCE(session->budget.timeout, MIN((u64) param, (u64) KTIME_MAX));
+      AUDIT printk("%s: somebody has set TIMEOUT_NS to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case DEADLINE:
+      // a budget for a sequence of operations, which the per-operation timeout would restart
+      WRITE_ONCE(session->budget.deadline, MIN((u64) param, (u64) KTIME_MAX));
+      AUDIT printk("%s: somebody has set DEADLINE to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case DEADLINE_LEFT:
+      // a timeout restarts with each operation, only a deadline has a budget left
+      if (READ_ONCE(session->budget.deadline) == 0)
+         return -EINVAL;
+      if (put_user(budget_left(READ_ONCE(session->budget.deadline), ktime_get_ns()), (__u64 __user *) param) != 0)
+         return -EFAULT;
+      break;
+   case BATCH:
+      return run_batch(session, (batch __user *) param);
+   case BUSY_POLL:
+      if (param > MAX_BUSY_POLL)
+         return -EINVAL;
+      // the first waits spin for the whole window, then it follows the waits observed
+      WRITE_ONCE(session->poll.limit, param * NSEC_PER_USEC);
+      WRITE_ONCE(session->poll.average, param * NSEC_PER_USEC / 2);
+      AUDIT printk("%s: somebody has set BUSY_POLL to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case DRR_READ:
+      if (param != 0) {
+         // a new round, from the current class
+         memset(session->deficit, 0, sizeof(session->deficit));
+         session->deficit[session->drr_class] = session->device->flows[session->drr_class].weight * DRR_QUANTUM;
+      }
+      session->read_mode = (param != 0) ? DEFICIT_ROUND_ROBIN : SINGLE_FLOW;
+      AUDIT printk("%s: somebody has set DRR_READ to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case STREAM_MODE:
+      session->stream = (param != 0);
+      AUDIT printk("%s: somebody has set STREAM_MODE to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case CONSUME_BYTES:
+      current_stream_state = session_flow(session);
+      if (current_stream_state->storage != RING_STORAGE)
+         return -EINVAL;
+
+      if ((ret = consumer_lock_interruptible(current_stream_state)) != 0)
+         return (ret == -ERESTARTSYS) ? -EINTR : ret;
+      if (param > atomic_read(&(current_stream_state->valid_bytes))) {
+         consumer_unlock(current_stream_state);
+         return -EINVAL;
+      }
+      ring_consume(current_stream_state, param);
+      trace_multi_flow_dequeue(current_stream_state->minor, current_stream_state->priority, param,
+         atomic_read(&(current_stream_state->valid_bytes)));
+      consumer_unlock(current_stream_state);
+      wake_up_after_read(current_stream_state);
+      break;
+   case SET_CAPACITY:
+      if (param < OBJECT_MAX_SIZE || param > MAX_CAPACITY)
+         return -EINVAL;
+      if ((ret = set_capacity(session->device, param)) != 0)
+         return ret;
+      AUDIT printk("%s: somebody has set CAPACITY to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case SPSC_MODE:
+      // the caller vouches there is a single producer and a single consumer: only its own session may be open
+      if (atomic_read(&session->device->sessions) != 1)
+         return -EBUSY;
+      if ((ret = set_spsc(session->device, param != 0)) != 0)
+         return ret;
+      AUDIT printk("%s: somebody has set SPSC_MODE to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case BIND_EVENTFD:
+      if ((ret = bind_eventfd(session, (int) param)) != 0)
+         return ret;
+      AUDIT printk("%s: somebody has set BIND_EVENTFD to %d on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, (int) param, get_major(filp), get_minor(filp), command);
+      break;
+   case DATAGRAM_MODE:
+      // the caller vouches nobody else is using the minor: only its own session may be open
+      if (atomic_read(&session->device->sessions) != 1)
+         return -EBUSY;
+      if ((ret = set_datagram(session->device, param != 0)) != 0)
+         return ret;
+      AUDIT printk("%s: somebody has set DATAGRAM_MODE to %lu on dev with " \
+      "[major,minor] number [%d,%d] and command %u \n", MODNAME, param, get_major(filp), get_minor(filp), command);
+      break;
+   case NEXT_RECORD_SIZE:
+      current_stream_state = session_flow(session);
+      if (!current_stream_state->datagram)
+         return -EINVAL;
+      if ((ret = consumer_lock_interruptible(current_stream_state)) != 0)
+         return (ret == -ERESTARTSYS) ? -EINTR : ret;
+      ret = record_size(current_stream_state);
+      consumer_unlock(current_stream_state);
+      return ret;
+   case WRITE_SEQUENCE:
+      // 64 bit counters, which the int return value of ioctl() would truncate
+      if (put_user(atomic64_read(&session->sequences[session->priority].sequence), (__u64 __user *) param) != 0)
+         return -EFAULT;
+      break;
+   case COMMITTED_SEQUENCE:
+      if (put_user(atomic64_read(&session->sequences[session->priority].committed), (__u64 __user *) param) != 0)
+         return -EFAULT;
+      break;
    default:
       AUDIT printk("%s: somebody called an invalid setting on dev with " \
       "[major,minor] number [%d,%d] and command %u \n", MODNAME, get_major(filp), get_minor(filp), command);
@@ -258,13 +537,126 @@ static long dev_ioctl(struct file *filp, unsigned int command, unsigned long par
 
 
 
+/*
+ * Readiness refers to the flow selected by the session (to any class for
+ * reading, with COMBINED_READ or DRR_READ), but every flow of the minor is
+ * watched so that a class switch does not leave the poller registered on the
+ * wrong queue.
+ */
+static __poll_t dev_poll(struct file *filp, poll_table *wait) {
+
+   __poll_t mask = 0;
+   int i, priority;
+   object_state *current_stream_state, *flows;
+   session *session;
+
+   session = filp -> private_data;
+   priority = session -> priority;
+   flows = session -> device -> flows;
+
+   for (i = 0; i < classes; i++) {
+      poll_wait(filp, &(flows[i].readers), wait);
+      poll_wait(filp, &(flows[i].writers), wait);
+   }
+
+   current_stream_state = &flows[priority];
+
+   if (atomic_read(&(current_stream_state -> valid_bytes)) > 0)
+      mask |= EPOLLIN | EPOLLRDNORM;
+   for (i = 0; i < classes && session -> read_mode != SINGLE_FLOW; i++)
+      if (atomic_read(&(flows[i].valid_bytes)) > 0)
+         mask |= EPOLLIN | EPOLLRDNORM;
+   if (writable_bytes(current_stream_state) > 0)
+      mask |= EPOLLOUT | EPOLLWRNORM;
+
+   return mask;
+}
+
+
+
+// mappings keep the ring from being resized (and freed) under them
+static void ring_vm_open(struct vm_area_struct *vma) {
+   object_state *current_stream_state = vma->vm_private_data;
+   atomic_inc(&(current_stream_state->mappings));
+}
+
+
+static void ring_vm_close(struct vm_area_struct *vma) {
+   object_state *current_stream_state = vma->vm_private_data;
+   atomic_dec(&(current_stream_state->mappings));
+}
+
+
+static const struct vm_operations_struct ring_vm_ops = {
+   .open = ring_vm_open,
+   .close = ring_vm_close,
+};
+
+
+/*
+ * Maps the control page and the ring of the flow selected by the session,
+ * read-only: readers drain bytes in place and release them with CONSUME_BYTES.
+ */
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+   session *session;
+   object_state *current_stream_state;
+   int ret;
+
+   session = filp->private_data;
+   current_stream_state = session_flow(session);
+
+   if (current_stream_state->storage != RING_STORAGE)
+      return -ENODEV;
+
+   if (vma->vm_flags & VM_WRITE)
+      return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+   vm_flags_clear(vma, VM_MAYWRITE);
+#else
+   vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+   // a resize in progress owns the ring
+   if (!atomic_inc_unless_negative(&(current_stream_state->mappings)))
+      return -EBUSY;
+
+   ret = remap_vmalloc_range(vma, current_stream_state->control, vma->vm_pgoff);
+   if (ret != 0) {
+      atomic_dec(&(current_stream_state->mappings));
+      return ret;
+   }
+
+   vma->vm_private_data = current_stream_state;
+   vma->vm_ops = &ring_vm_ops;
+
+   AUDIT printk("%s: somebody has mapped the ring of dev with [major,minor] number [%d,%d]\n",
+      MODNAME, get_major(filp), get_minor(filp));
+
+   return 0;
+}
+
+
+
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .write = dev_write,
     .read = dev_read,
     .open = dev_open,
     .release = dev_release,
-    .unlocked_ioctl = dev_ioctl
+    .unlocked_ioctl = dev_ioctl,
+    .mmap = dev_mmap,
+    .poll = dev_poll,
+    .read_iter = dev_read_iter,
+    .write_iter = dev_write_iter,
+    // splice()/sendfile() copy once between the flow and the pipe pages, through the iter entry points
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write
 };
 
 
@@ -272,86 +664,92 @@ static struct file_operations fops = {
 
 int init_module(void) {
 
-   int i, j;
-   // initialize the driver internal state
-   for (i = 0; i < MINORS; i++)
-   {
+   int i;
 
-      for (j = 0; j < DATA_FLOWS; j++)
-      {
+   audit_ready = true;
+   sync_audit();
 
-         mutex_init(&(objects[i][j].operation_synchronizer));
+   if (max_minors <= 0 || max_minors > MAX_MINORS)
+   {
+      printk("%s: invalid max_minors %d, using %d\n", MODNAME, max_minors, MINORS);
+      max_minors = MINORS;
+   }
 
-         objects[i][j].head = kzalloc(sizeof(data_segment), GFP_KERNEL);
-         objects[i][j].tail = kzalloc(sizeof(data_segment), GFP_KERNEL);
-         if (objects[i][j].head == NULL || objects[i][j].tail == NULL)
-         {
-            printk("%s: unable to allocate a new data_segment\n", MODNAME);
-            goto revert_allocation;
-         }
+   if (classes < 2 || classes > DATA_FLOWS)
+   {
+      printk("%s: invalid classes %d, using 2\n", MODNAME, classes);
+      classes = 2;
+   }
 
-         objects[i][j].head->next = (objects[i][j].tail);
-         objects[i][j].head->previous = NULL;
-         objects[i][j].head->buffer = NULL;
+   for (i = 0; i < DATA_FLOWS; i++)
+   {
+      if (class_weight[i] < 1)
+      {
+         printk("%s: invalid weight %d for class %d, using 1\n", MODNAME, class_weight[i], i);
+         class_weight[i] = 1;
+      }
+   }
 
-         objects[i][j].tail->next = NULL;
-         objects[i][j].tail->previous = (objects[i][j].head);
-         objects[i][j].tail->buffer = NULL;
+   for (i = 0; i < MINORS; i++)
+   {
+      if (capacity[i] == 0)
+         capacity[i] = OBJECT_MAX_SIZE;
+      else if (capacity[i] < OBJECT_MAX_SIZE || capacity[i] > MAX_CAPACITY)
+      {
+         printk("%s: invalid capacity %d for minor %d, using %d bytes\n", MODNAME, capacity[i], i, OBJECT_MAX_SIZE);
+         capacity[i] = OBJECT_MAX_SIZE;
+      }
+   }
 
-         init_waitqueue_head(&objects[i][j].wq);
+   if (init_pools() != 0)
+   {
+      printk("%s: unable to create the memory pools\n", MODNAME);
+      return -ENOMEM;
+   }
 
-      }
+   if (init_deferred_queue() != 0)
+   {
+      printk("%s: unable to create the deferred write workqueue\n", MODNAME);
+      destroy_pools();
+      return -ENOMEM;
    }
 
-   Major = __register_chrdev(0, 0, 256, DEVICE_NAME, &fops);
+   // the state of each minor is only allocated on its first open, see minors.h
+   Major = __register_chrdev(0, 0, max_minors, DEVICE_NAME, &fops);
    // actually allowed minors are directly controlled within this driver
 
    if (Major < 0)
    {
       printk("%s: registering device failed\n", MODNAME);
+      destroy_deferred_queue();
+      destroy_pools();
       return Major;
    }
 
+   // statistics are still collected without debugfs, they just cannot be read
+   if (init_stats_debugfs() != 0)
+      printk("%s: unable to create the debugfs statistics\n", MODNAME);
+
    AUDIT printk(KERN_INFO "%s: new device registered, it is assigned major number %d\n", MODNAME, Major);
 
    return 0;
-
-revert_allocation:
-   for (; i >= 0; i--)
-   {
-      for (; j >= 0; j--)
-      {
-         kfree(objects[i][j].head);
-         kfree(objects[i][j].tail);
-      }
-   }
-   return -ENOMEM;
 }
 
 
 
 void cleanup_module(void) {
 
-   int i, j;
-   object_state *node;
-   data_segment *head, *current_segment;
+   destroy_stats_debugfs();
 
-   for (i = 0; i < MINORS; i++)
-   {
-      for (j = 0; j < DATA_FLOWS; j++)
-      {
-         node = &(objects[i][j]);
-         head = node -> head;
-         while ( (head -> next) != (node -> tail)) {
-            current_segment = head -> next;
-            head->next = head->next->next;
-            kfree(current_segment->buffer);
-            kfree(current_segment);
-         }
-      }
-   }
+   // no deferred work can be queued here, each one holds a reference to the module
+   destroy_deferred_queue();
+
+   // minors left with bytes in their flows
+   destroy_minors();
+
+   __unregister_chrdev(Major, 0, max_minors, DEVICE_NAME);
 
-   unregister_chrdev(Major, DEVICE_NAME);
+   destroy_pools();
 
    AUDIT printk(KERN_INFO "%s: new device unregistered, it was assigned major number %d\n", MODNAME, Major);
 
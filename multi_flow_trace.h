@@ -0,0 +1,169 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM multi_flow
+
+#if !defined(_MULTI_FLOW_TRACEH_) || defined(TRACE_HEADER_MULTI_READ)
+#define _MULTI_FLOW_TRACEH_
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the data path, disabled (a patched out branch) unless turned
+ * on through ftrace or perf, e.g.
+ *
+ *      echo 1 > /sys/kernel/tracing/events/multi_flow/enable
+ *      perf record -e 'multi_flow:*' -a
+ *
+ * priority is the class of the flow (0 the lowest, up to classes - 1), or -1
+ * for the waits of COMBINED_READ and DRR_READ on every class; writer tells
+ * waits for room apart from waits for bytes.
+ */
+
+TRACE_EVENT(multi_flow_open,
+
+   TP_PROTO(int minor, int sessions),
+
+   TP_ARGS(minor, sessions),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, sessions)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->sessions = sessions;
+   ),
+
+   TP_printk("minor=%d sessions=%d", __entry->minor, __entry->sessions)
+);
+
+
+DECLARE_EVENT_CLASS(multi_flow_transfer,
+
+   TP_PROTO(int minor, int priority, size_t bytes, int valid_bytes),
+
+   TP_ARGS(minor, priority, bytes, valid_bytes),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, priority)
+      __field(size_t, bytes)
+      __field(int, valid_bytes)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->priority = priority;
+      __entry->bytes = bytes;
+      __entry->valid_bytes = valid_bytes;
+   ),
+
+   TP_printk("minor=%d priority=%d bytes=%zu valid_bytes=%d",
+      __entry->minor, __entry->priority, __entry->bytes, __entry->valid_bytes)
+);
+
+
+// bytes appended to the flow, or queued for the deferred work on the low priority one
+DEFINE_EVENT(multi_flow_transfer, multi_flow_enqueue,
+   TP_PROTO(int minor, int priority, size_t bytes, int valid_bytes),
+   TP_ARGS(minor, priority, bytes, valid_bytes)
+);
+
+
+DEFINE_EVENT(multi_flow_transfer, multi_flow_dequeue,
+   TP_PROTO(int minor, int priority, size_t bytes, int valid_bytes),
+   TP_ARGS(minor, priority, bytes, valid_bytes)
+);
+
+
+DECLARE_EVENT_CLASS(multi_flow_wait,
+
+   TP_PROTO(int minor, int priority, int writer, u64 timeout),
+
+   TP_ARGS(minor, priority, writer, timeout),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, priority)
+      __field(int, writer)
+      __field(u64, timeout)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->priority = priority;
+      __entry->writer = writer;
+      __entry->timeout = timeout;
+   ),
+
+   TP_printk("minor=%d priority=%d writer=%d timeout_ns=%llu",
+      __entry->minor, __entry->priority, __entry->writer, __entry->timeout)
+);
+
+
+DEFINE_EVENT(multi_flow_wait, multi_flow_wait_start,
+   TP_PROTO(int minor, int priority, int writer, u64 timeout),
+   TP_ARGS(minor, priority, writer, timeout)
+);
+
+
+DEFINE_EVENT(multi_flow_wait, multi_flow_timeout,
+   TP_PROTO(int minor, int priority, int writer, u64 timeout),
+   TP_ARGS(minor, priority, writer, timeout)
+);
+
+
+// ret is 1 when ready, 0 on timeout or a negative error (-ERESTARTSYS on signals)
+TRACE_EVENT(multi_flow_wait_end,
+
+   TP_PROTO(int minor, int priority, int writer, long ret),
+
+   TP_ARGS(minor, priority, writer, ret),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, priority)
+      __field(int, writer)
+      __field(long, ret)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->priority = priority;
+      __entry->writer = writer;
+      __entry->ret = ret;
+   ),
+
+   TP_printk("minor=%d priority=%d writer=%d ret=%ld",
+      __entry->minor, __entry->priority, __entry->writer, __entry->ret)
+);
+
+
+TRACE_EVENT(multi_flow_deferred_write,
+
+   TP_PROTO(int minor, int bytes, int segments),
+
+   TP_ARGS(minor, bytes, segments),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, bytes)
+      __field(int, segments)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->bytes = bytes;
+      __entry->segments = segments;
+   ),
+
+   TP_printk("minor=%d bytes=%d segments=%d", __entry->minor, __entry->bytes, __entry->segments)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE multi_flow_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,245 @@
+#include "info.h"
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+
+#ifndef _POOLH_
+#define _POOLH_
+
+#define SEGMENT_POOL 0
+#define PAYLOAD_POOL 1                          // first payload size class
+#define PAYLOAD_CLASSES 4
+#define POOLS (PAYLOAD_POOL + PAYLOAD_CLASSES)
+#define PAYLOAD_CLASS_SIZE(class) (64 << (2 * (class)))   // 64, 256, 1024, 4096 bytes
+#define OVERSIZED_PAYLOAD -1
+#define STREAM_CHUNK PAYLOAD_CLASS_SIZE(PAYLOAD_CLASSES - 1)   // payload of the segments small stream writes are packed into
+
+static int pool_reserve = 16;
+module_param(pool_reserve, int, 0440);
+MODULE_PARM_DESC(pool_reserve, "Number of objects each pool keeps in reserve, so that non-blocking " \
+"writes can still allocate under memory pressure.");
+
+// per CPU, so that allocations never share a cacheline across CPUs; summed up when read
+typedef struct _pool_counters
+{
+        unsigned long hits[POOLS];
+        unsigned long misses[POOLS];
+
+} pool_counters;
+
+static DEFINE_PER_CPU(pool_counters, pool_stats);
+
+
+// the counters of every pool as a module_param_array would print them
+static int get_pool_counters(char *buffer, int misses) {
+
+   pool_counters *counters;
+   unsigned long sum;
+   int i, cpu, len = 0;
+
+   for (i = 0; i < POOLS; i++) {
+      sum = 0;
+      for_each_possible_cpu(cpu) {
+         counters = per_cpu_ptr(&pool_stats, cpu);
+         sum += misses ? counters -> misses[i] : counters -> hits[i];
+      }
+      len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%lu", (i > 0) ? "," : "", sum);
+   }
+   len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+
+   return len;
+}
+
+static int get_pool_hits(char *buffer, const struct kernel_param *kp) {
+   return get_pool_counters(buffer, 0);
+}
+
+static int get_pool_misses(char *buffer, const struct kernel_param *kp) {
+   return get_pool_counters(buffer, 1);
+}
+
+static const struct kernel_param_ops pool_hits_ops = {
+   .get = get_pool_hits,
+};
+module_param_cb(pool_hits, &pool_hits_ops, NULL, 0440);
+MODULE_PARM_DESC(pool_hits, "Allocations served by the slab caches, per pool " \
+"(data segments, then payload size classes of 64, 256, 1024 and 4096 bytes).");
+
+static const struct kernel_param_ops pool_misses_ops = {
+   .get = get_pool_misses,
+};
+module_param_cb(pool_misses, &pool_misses_ops, NULL, 0440);
+MODULE_PARM_DESC(pool_misses, "Allocations that fell back to the reserve of the pool (or failed), per pool. " \
+"For the largest payload class it also counts payloads too big for any class.");
+
+static struct kmem_cache *caches[POOLS];
+static mempool_t *pools[POOLS];
+
+
+int init_pools(void);
+void destroy_pools(void);
+void *pool_alloc(int, gfp_t);
+void pool_free(int, void *);
+data_segment *alloc_data_segment(size_t, gfp_t);
+ssize_t free_data_segment(data_segment *, ssize_t);
+void free_payload(data_segment *);
+size_t segment_room(data_segment *);
+data_segment *alloc_dummy_segment(void);
+void free_segment_chain(data_segment *);
+
+
+int init_pools(void) {
+
+   int i;
+   char name[32];
+
+   caches[SEGMENT_POOL] = kmem_cache_create("multi_flow_segment", sizeof(data_segment), 0, SLAB_HWCACHE_ALIGN, NULL);
+
+   for (i = 0; i < PAYLOAD_CLASSES; i++) {
+      snprintf(name, sizeof(name), "multi_flow_payload_%d", PAYLOAD_CLASS_SIZE(i));
+      caches[PAYLOAD_POOL + i] = kmem_cache_create(name, PAYLOAD_CLASS_SIZE(i), 0, 0, NULL);
+   }
+
+   for (i = 0; i < POOLS; i++) {
+      if (caches[i] == NULL)
+         goto revert_pools;
+      pools[i] = mempool_create_slab_pool(pool_reserve, caches[i]);
+      if (pools[i] == NULL)
+         goto revert_pools;
+   }
+
+   return 0;
+
+revert_pools:
+   destroy_pools();
+   return -ENOMEM;
+}
+
+
+void destroy_pools(void) {
+
+   int i;
+
+   for (i = 0; i < POOLS; i++) {
+      if (pools[i] != NULL)
+         mempool_destroy(pools[i]);
+      if (caches[i] != NULL)
+         kmem_cache_destroy(caches[i]);
+      pools[i] = NULL;
+      caches[i] = NULL;
+   }
+}
+
+
+/*
+ * The slab cache is tried first; only when it fails (typically a GFP_ATOMIC
+ * request under memory pressure) the element is taken from the reserve of the
+ * mempool, which is refilled as elements are given back.
+ */
+void *pool_alloc(int pool, gfp_t flags) {
+
+   void *element;
+
+   element = kmem_cache_alloc(caches[pool], flags | __GFP_NOWARN);
+   if (likely(element != NULL)) {
+      this_cpu_inc(pool_stats.hits[pool]);
+      return element;
+   }
+
+   this_cpu_inc(pool_stats.misses[pool]);
+   return mempool_alloc(pools[pool], flags);
+}
+
+
+void pool_free(int pool, void *element) {
+   mempool_free(element, pools[pool]);
+}
+
+
+data_segment *alloc_data_segment(size_t len, gfp_t flags) {
+
+   data_segment *new_segment;
+   int class;
+
+   new_segment = (data_segment *) pool_alloc(SEGMENT_POOL, flags);
+   if (unlikely(new_segment == NULL))
+            return NULL;
+
+   memset(new_segment, 0, sizeof(data_segment));
+
+   for (class = 0; class < PAYLOAD_CLASSES; class++)
+            if (len <= PAYLOAD_CLASS_SIZE(class))
+                     break;
+
+   if (likely(class < PAYLOAD_CLASSES)) {
+            new_segment -> pool = PAYLOAD_POOL + class;
+            new_segment -> buffer = (char *) pool_alloc(new_segment -> pool, flags);
+   } else {
+            this_cpu_inc(pool_stats.misses[POOLS - 1]);
+            new_segment -> pool = OVERSIZED_PAYLOAD;
+            new_segment -> buffer = (char *) kvmalloc(len, flags);
+   }
+
+   if (unlikely(new_segment -> buffer == NULL)) {
+            free_data_segment(new_segment, ENOMEM);
+            return NULL;
+   }
+
+   return new_segment;
+}
+
+
+void free_payload( data_segment *segment ) {
+   if (likely(segment -> buffer != NULL)) {
+            if (likely(segment -> pool != OVERSIZED_PAYLOAD))
+                     pool_free(segment -> pool, segment -> buffer);
+            else
+                     kvfree(segment -> buffer);
+   }
+   segment -> buffer = NULL;
+}
+
+
+// spare bytes past the data of a segment, up to the size class of its payload
+size_t segment_room( data_segment *segment ) {
+   if (segment -> buffer == NULL || segment -> pool == OVERSIZED_PAYLOAD)
+            return 0;
+   return PAYLOAD_CLASS_SIZE(segment -> pool - PAYLOAD_POOL) - segment -> actual_size;
+}
+
+
+ssize_t free_data_segment( data_segment *segment, ssize_t error ) {
+   if (segment == NULL)
+            return -error;
+   free_payload(segment);
+   pool_free(SEGMENT_POOL, segment);
+   return -error;
+}
+
+
+// segment without payload, used as the dummy head of a flow
+data_segment *alloc_dummy_segment(void) {
+
+   data_segment *dummy;
+
+   dummy = (data_segment *) pool_alloc(SEGMENT_POOL, GFP_KERNEL);
+   if (dummy != NULL)
+            memset(dummy, 0, sizeof(data_segment));
+
+   return dummy;
+}
+
+
+// frees a list of segments linked through next and not yet in any flow
+void free_segment_chain(data_segment *chain) {
+
+   data_segment *current_segment;
+
+   while (chain != NULL) {
+            current_segment = chain;
+            chain = chain -> next;
+            free_data_segment(current_segment, 0);
+   }
+}
+
+
+#endif
@@ -1,45 +1,198 @@
 #include "info.h"
+#include "ring.h"
+#include "pool.h"
+
+#ifndef _READH_
+#define _READH_
 
 int read(object_state *, char __user *, size_t);
+int read_to_iter(object_state *, struct iov_iter *);
+data_segment *first_segment(object_state *);
+void consume_bytes(object_state *, data_segment *, size_t);
+int record_size(object_state *);
+int read_record(object_state *, char __user *, size_t);
+int read_records_to_iter(object_state *, struct iov_iter *);
+
+
+/*
+ * The flow is a two-lock (Michael-Scott) queue: head is a dummy segment and
+ * the data starts at head -> next. Once a segment has been read entirely it
+ * becomes the new dummy and the old one is freed, so readers never touch a
+ * segment writers may still be linking to.
+ */
+data_segment *first_segment(object_state *current_stream_state) {
+   return smp_load_acquire(&(current_stream_state -> head -> next));
+}
+
+
+void consume_bytes(object_state *current_stream_state, data_segment *current_segment, size_t len) {
+
+   data_segment *dummy;
+
+   current_segment -> off += len;
+
+   if (current_segment -> off == current_segment -> actual_size) {
+            dummy = current_stream_state -> head;
+            current_stream_state -> head = current_segment;
+            free_payload(current_segment);
+            free_data_segment(dummy, 0);
+   }
+}
+
+
+/*
+ * In datagram mode every segment is a record, written whole and read whole:
+ * off stays 0 since a record that does not fit the buffer is left in place.
+ * Called with the consumer lock held; 0 if the flow is empty.
+ */
+int record_size(object_state *current_stream_state) {
+
+   if (atomic_read_acquire(&(current_stream_state -> valid_bytes)) == 0)
+            return 0;
+   return first_segment(current_stream_state) -> actual_size;
+}
+
+
+// the next record, -EMSGSIZE if larger than len (see NEXT_RECORD_SIZE)
+int read_record(object_state *current_stream_state, char __user *buff, size_t len) {
+
+   size_t size;
+   data_segment *current_segment;
+
+   size = record_size(current_stream_state);
+   if (unlikely(size == 0))
+            return -EAGAIN;
+   if (size > len)
+            return -EMSGSIZE;
+
+   current_segment = first_segment(current_stream_state);
+   if (unlikely(copy_to_user(buff, current_segment -> buffer, size) != 0))
+            return -EFAULT;
+   consume_bytes(current_stream_state, current_segment, size);
+
+   smp_mb__before_atomic();
+   atomic_sub(size, &(current_stream_state -> valid_bytes));
+
+   return size;
+}
+
+
+/*
+ * One record per iovec, as long as the next record fits the next iovec: the
+ * rest of a partly filled iovec is skipped. Iterators that are not made of
+ * iovecs take a single record.
+ */
+int read_records_to_iter(object_state *current_stream_state, struct iov_iter *to) {
+
+   size_t size, room, read_bytes;
+   data_segment *current_segment;
+
+   read_bytes = 0;
+
+   while ((size = record_size(current_stream_state)) > 0) {
+
+      room = iter_is_iovec(to) ? iov_iter_single_seg_count(to) : iov_iter_count(to);
+      if (size > room)
+               break;
+
+      current_segment = first_segment(current_stream_state);
+      if (unlikely(copy_to_iter(current_segment -> buffer, size, to) != size))
+               return (read_bytes > 0) ? read_bytes : -EFAULT;
+      consume_bytes(current_stream_state, current_segment, size);
+
+      smp_mb__before_atomic();
+      atomic_sub(size, &(current_stream_state -> valid_bytes));
+      read_bytes += size;
+
+      if (!iter_is_iovec(to) || iov_iter_count(to) == 0)
+               break;
+      iov_iter_advance(to, room - size);
+   }
+
+   if (read_bytes > 0)
+            return read_bytes;
+   return (record_size(current_stream_state) == 0) ? -EAGAIN : -EMSGSIZE;
+}
 
 
 int read(object_state *current_stream_state, char __user *buff, size_t len) {
 
    int res;
    size_t read_bytes, current_readable_bytes, current_read_len;
-   data_segment *current_segment, *head;
+   data_segment *current_segment;
 
-   if (unlikely(current_stream_state -> valid_bytes == 0))
+   if (current_stream_state -> storage == RING_STORAGE)
+            return ring_read(current_stream_state, buff, len);
+
+   if (current_stream_state -> datagram)
+            return read_record(current_stream_state, buff, len);
+
+   // writers link segments before accounting for them, never read past valid_bytes
+   len = MIN(len, (size_t) atomic_read_acquire(&(current_stream_state -> valid_bytes)));
+   if (unlikely(len == 0))
             return -EAGAIN;
 
    read_bytes = 0;
 
-   head = current_stream_state -> head;
+   while (len > read_bytes) {
 
-   while ((head -> next != current_stream_state -> tail) && (len > read_bytes)) {
-      
-      current_segment = head -> next;
+      current_segment = first_segment(current_stream_state);
       current_readable_bytes = current_segment -> actual_size - current_segment -> off;
       current_read_len = MIN(len - read_bytes, current_readable_bytes);
 
       res = copy_to_user(buff + read_bytes, &(current_segment -> buffer[current_segment -> off]), current_read_len);
 
       read_bytes += ( current_read_len - res );
-      current_segment -> off += ( current_read_len - res );
+      consume_bytes(current_stream_state, current_segment, current_read_len - res);
 
-      if (current_segment -> off == current_segment -> actual_size) {
-               head->next = head->next->next;
-               head->next->previous = head;
+      if (unlikely(res != 0))
+               break;
+   }
 
-               kfree(current_segment -> buffer);
-               kfree(current_segment);
-      }
+   smp_mb__before_atomic();
+   atomic_sub(read_bytes, &(current_stream_state -> valid_bytes));
 
-      if (unlikely(res != 0))
+   return read_bytes;
+}
+
+
+int read_to_iter(object_state *current_stream_state, struct iov_iter *to) {
+
+   size_t len, read_bytes, current_readable_bytes, current_read_len, res;
+   data_segment *current_segment;
+
+   if (current_stream_state -> storage == RING_STORAGE)
+            return ring_read_to_iter(current_stream_state, to);
+
+   if (current_stream_state -> datagram)
+            return read_records_to_iter(current_stream_state, to);
+
+   len = MIN(iov_iter_count(to), (size_t) atomic_read_acquire(&(current_stream_state -> valid_bytes)));
+   if (unlikely(len == 0))
+            return -EAGAIN;
+
+   read_bytes = 0;
+
+   while (len > read_bytes) {
+
+      current_segment = first_segment(current_stream_state);
+      current_readable_bytes = current_segment -> actual_size - current_segment -> off;
+      current_read_len = MIN(len - read_bytes, current_readable_bytes);
+
+      res = copy_to_iter(&(current_segment -> buffer[current_segment -> off]), current_read_len, to);
+
+      read_bytes += res;
+      consume_bytes(current_stream_state, current_segment, res);
+
+      if (unlikely(res != current_read_len))
                break;
    }
 
-   current_stream_state->valid_bytes -= read_bytes;
+   smp_mb__before_atomic();
+   atomic_sub(read_bytes, &(current_stream_state -> valid_bytes));
 
    return read_bytes;
-}
\ No newline at end of file
+}
+
+
+#endif
@@ -0,0 +1,258 @@
+#include "info.h"
+
+#ifndef _RINGH_
+#define _RINGH_
+
+flow_control *ring_area_alloc(int);
+int ring_alloc(object_state *);
+void ring_free(object_state *);
+int ring_resize(object_state *, flow_control **, int);
+int ring_write(object_state *, const char __user *, size_t);
+int ring_read(object_state *, char __user *, size_t);
+size_t ring_write_iter(object_state *, struct iov_iter *, size_t);
+int ring_read_to_iter(object_state *, struct iov_iter *);
+void ring_unreserve(object_state *, size_t);
+void ring_commit(object_state *, size_t);
+void ring_consume(object_state *, size_t);
+
+
+/*
+ * The ring is a preallocated buffer of capacity bytes. ring_head is the
+ * offset of the first readable byte, ring_tail the offset where the next byte
+ * is reserved. Reserved bytes are valid_bytes + pending_bytes, and writers never
+ * reserve more than writable_bytes(), so the tail can never overrun the head.
+ *
+ * Writers only move ring_tail and readers only ring_head, so with split locks
+ * the two sides are ordered by the atomic valid_bytes alone.
+ *
+ * The ring lives in vmalloc'ed memory right after the control page, so that
+ * the whole area can be mapped in user space (see dev_mmap) and can grow to
+ * many megabytes without needing contiguous pages.
+ */
+
+
+flow_control *ring_area_alloc(int capacity) {
+
+   flow_control *control;
+
+   control = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(capacity));
+   if (control == NULL)
+      return NULL;
+
+   control -> size = capacity;
+   control -> data_offset = PAGE_SIZE;
+
+   return control;
+}
+
+
+int ring_alloc(object_state *current_stream_state) {
+
+   current_stream_state -> control = ring_area_alloc(current_stream_state -> capacity);
+   if (current_stream_state -> control == NULL)
+      return -ENOMEM;
+
+   current_stream_state -> ring = (char *) current_stream_state -> control + PAGE_SIZE;
+
+   return 0;
+}
+
+
+void ring_free(object_state *current_stream_state) {
+   vfree(current_stream_state -> control);
+   current_stream_state -> control = NULL;
+   current_stream_state -> ring = NULL;
+}
+
+
+/*
+ * Both locks of the flow, producer first: just the one mutex without
+ * split_locks. spsc rings are never resized.
+ */
+static void resize_lock(object_state *current_stream_state) {
+   mutex_lock(producer_mutex(current_stream_state));
+   if (consumer_mutex(current_stream_state) != producer_mutex(current_stream_state))
+      mutex_lock(consumer_mutex(current_stream_state));
+}
+
+
+static void resize_unlock(object_state *current_stream_state) {
+   if (consumer_mutex(current_stream_state) != producer_mutex(current_stream_state))
+      mutex_unlock(consumer_mutex(current_stream_state));
+   mutex_unlock(producer_mutex(current_stream_state));
+}
+
+
+/*
+ * Moves the reserved bytes of the ring into the area in *control, of the given
+ * capacity, and hands the old area back through *control for the caller to
+ * free. Called with no lock held and resizing set, so no writer reserves
+ * bytes (see writable_bytes): the locks are only taken while the head is
+ * sampled and while the areas are swapped, so readers (and the deferred
+ * work, which just makes reserved bytes visible) carry on during the copy
+ * whether or not the flow has split_locks. The bytes readers drain from the
+ * old ring in the meanwhile are skipped in the new one. Bytes are laid out
+ * at consumed % capacity, as mmap users expect.
+ */
+int ring_resize(object_state *current_stream_state, flow_control **control, int capacity) {
+
+   size_t head, reserved, start, copied, from, to, chunk;
+   __u64 consumed, drained;
+   char *ring;
+
+   resize_lock(current_stream_state);
+   head = current_stream_state -> ring_head;
+   consumed = current_stream_state -> control -> consumed;
+   reserved = atomic_read(&(current_stream_state -> valid_bytes)) + atomic_read(&(current_stream_state -> pending_bytes));
+   resize_unlock(current_stream_state);
+
+   if (reserved > capacity)
+      return -EBUSY;
+
+   ring = (char *) *control + PAGE_SIZE;
+   drained = consumed;
+   start = do_div(drained, capacity);
+
+   for (copied = 0; copied < reserved; copied += chunk) {
+      from = (head + copied) % current_stream_state -> capacity;
+      to = (start + copied) % capacity;
+      chunk = MIN(reserved - copied, MIN(current_stream_state -> capacity - from, capacity - to));
+      memcpy(&ring[to], &(current_stream_state -> ring[from]), chunk);
+   }
+
+   resize_lock(current_stream_state);
+
+   drained = current_stream_state -> control -> consumed - consumed;
+   (*control) -> produced = current_stream_state -> control -> produced;
+   (*control) -> consumed = current_stream_state -> control -> consumed;
+
+   current_stream_state -> ring_head = (start + drained) % capacity;
+   current_stream_state -> ring_tail = (start + reserved) % capacity;
+   swap(current_stream_state -> control, *control);
+   current_stream_state -> ring = ring;
+   WRITE_ONCE(current_stream_state -> capacity, capacity);
+
+   resize_unlock(current_stream_state);
+
+   return 0;
+}
+
+
+int ring_write(object_state *current_stream_state, const char __user *buff, size_t len) {
+
+   size_t first, written;
+   int res;
+
+   first = MIN(len, current_stream_state -> capacity - current_stream_state -> ring_tail);
+
+   res = copy_from_user(&(current_stream_state -> ring[current_stream_state -> ring_tail]), buff, first);
+   written = first - res;
+
+   if (likely(res == 0 && len > first)) {
+      res = copy_from_user(current_stream_state -> ring, buff + first, len - first);
+      written += (len - first) - res;
+   }
+
+   current_stream_state -> ring_tail = (current_stream_state -> ring_tail + written) % current_stream_state -> capacity;
+
+   return written;
+}
+
+
+void ring_unreserve(object_state *current_stream_state, size_t len) {
+   current_stream_state -> ring_tail = (current_stream_state -> ring_tail + current_stream_state -> capacity - len) % current_stream_state -> capacity;
+}
+
+
+int ring_read(object_state *current_stream_state, char __user *buff, size_t len) {
+
+   size_t to_read, first, read_bytes;
+   int res;
+
+   to_read = MIN(len, (size_t) atomic_read_acquire(&(current_stream_state -> valid_bytes)));
+   if (unlikely(to_read == 0))
+            return -EAGAIN;
+
+   first = MIN(to_read, current_stream_state -> capacity - current_stream_state -> ring_head);
+
+   res = copy_to_user(buff, &(current_stream_state -> ring[current_stream_state -> ring_head]), first);
+   read_bytes = first - res;
+
+   if (likely(res == 0 && to_read > first)) {
+      res = copy_to_user(buff + first, current_stream_state -> ring, to_read - first);
+      read_bytes += (to_read - first) - res;
+   }
+
+   ring_consume(current_stream_state, read_bytes);
+
+   return read_bytes;
+}
+
+
+size_t ring_write_iter(object_state *current_stream_state, struct iov_iter *from, size_t len) {
+
+   size_t first, written;
+
+   first = MIN(len, current_stream_state -> capacity - current_stream_state -> ring_tail);
+
+   written = copy_from_iter(&(current_stream_state -> ring[current_stream_state -> ring_tail]), first, from);
+   if (likely(written == first && len > first))
+      written += copy_from_iter(current_stream_state -> ring, len - first, from);
+
+   current_stream_state -> ring_tail = (current_stream_state -> ring_tail + written) % current_stream_state -> capacity;
+
+   return written;
+}
+
+
+int ring_read_to_iter(object_state *current_stream_state, struct iov_iter *to) {
+
+   size_t to_read, first, read_bytes;
+
+   to_read = MIN(iov_iter_count(to), (size_t) atomic_read_acquire(&(current_stream_state -> valid_bytes)));
+   if (unlikely(to_read == 0))
+            return -EAGAIN;
+
+   first = MIN(to_read, current_stream_state -> capacity - current_stream_state -> ring_head);
+
+   read_bytes = copy_to_iter(&(current_stream_state -> ring[current_stream_state -> ring_head]), first, to);
+   if (likely(read_bytes == first && to_read > first))
+      read_bytes += copy_to_iter(current_stream_state -> ring, to_read - first, to);
+
+   ring_consume(current_stream_state, read_bytes);
+
+   return read_bytes;
+}
+
+
+/*
+ * makes bytes already copied in the ring visible to readers. In spsc mode
+ * nobody else passes wakeups on, so the reader is woken up here, and only
+ * when the flow goes from empty to non-empty.
+ */
+void ring_commit(object_state *current_stream_state, size_t len) {
+
+   int valid;
+
+   valid = atomic_add_return(len, &(current_stream_state -> valid_bytes));
+   WRITE_ONCE(current_stream_state -> control -> produced, current_stream_state -> control -> produced + len);
+
+   if (current_stream_state -> spsc && valid == len)
+      wake_up_readers(current_stream_state);
+}
+
+
+// likewise, in spsc mode the writer is woken up when a full flow gets room
+void ring_consume(object_state *current_stream_state, size_t len) {
+
+   int valid;
+
+   current_stream_state -> ring_head = (current_stream_state -> ring_head + len) % current_stream_state -> capacity;
+   valid = atomic_sub_return(len, &(current_stream_state -> valid_bytes));
+   WRITE_ONCE(current_stream_state -> control -> consumed, current_stream_state -> control -> consumed + len);
+
+   if (current_stream_state -> spsc && valid + len == current_stream_state -> capacity)
+      wake_up_writers(current_stream_state);
+}
+
+#endif
@@ -0,0 +1,246 @@
+#include "info.h"
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#ifndef _STATSH_
+#define _STATSH_
+
+#define READ_OP 0
+#define WRITE_OP 1
+#define WAIT_HISTOGRAM 0                        // time spent by blocking operations waiting.
+#define VISIBLE_HISTOGRAM 1                     // deferred writes, from enqueue to visible.
+#define DEPTH_HISTOGRAM 2                       // pending segments drained by a deferred run.
+#define HISTOGRAMS 3
+#define HISTOGRAM_BUCKETS 24                    // bucket i counts values in [2^i, 2^(i+1)), the last one anything above
+
+/*
+ * Per-CPU statistics of a flow: every CPU only touches its own copy, the
+ * copies are summed up when the debugfs file is read. Times are in
+ * microseconds.
+ */
+typedef struct _flow_stats
+{
+        unsigned long ops[2];                   // successful reads and writes.
+        unsigned long bytes[2];                 // bytes read and written.
+        unsigned long eagain;                   // operations failed with -EAGAIN (empty or full flow).
+        unsigned long ebusy;                    // operations failed with -EBUSY (lock taken).
+        unsigned long etime;                    // blocking operations timed out.
+        unsigned long deferred_runs;            // runs of the deferred work.
+        unsigned long deferred_segments;        // segments drained by those runs.
+        unsigned long histograms[HISTOGRAMS][HISTOGRAM_BUCKETS];
+
+} flow_stats;
+
+static struct dentry *stats_dir;
+
+
+int alloc_stats(object_state *);
+void free_stats(object_state *);
+void account_op(object_state *, int, long);
+void account_histogram(object_state *, int, u64);
+void account_wait(object_state *, u64);
+void account_deferred(object_state *, int);
+int init_stats_debugfs(void);
+void destroy_stats_debugfs(void);
+
+
+int alloc_stats(object_state *the_object) {
+   the_object -> stats = alloc_percpu(flow_stats);
+   return (the_object -> stats == NULL) ? -ENOMEM : 0;
+}
+
+
+void free_stats(object_state *the_object) {
+   free_percpu(the_object -> stats);
+   the_object -> stats = NULL;
+}
+
+
+// outcome of a read or write returning ret
+void account_op(object_state *the_object, int op, long ret) {
+
+   if (likely(ret > 0)) {
+      this_cpu_inc(the_object -> stats -> ops[op]);
+      this_cpu_add(the_object -> stats -> bytes[op], ret);
+      return;
+   }
+
+   switch (ret) {
+   case -EAGAIN:
+      this_cpu_inc(the_object -> stats -> eagain);
+      break;
+   case -EBUSY:
+      this_cpu_inc(the_object -> stats -> ebusy);
+      break;
+   case -ETIME:
+      this_cpu_inc(the_object -> stats -> etime);
+      break;
+   }
+}
+
+
+void account_histogram(object_state *the_object, int histogram, u64 value) {
+
+   int bucket;
+
+   bucket = (value == 0) ? 0 : MIN(ilog2(value), HISTOGRAM_BUCKETS - 1);
+   this_cpu_inc(the_object -> stats -> histograms[histogram][bucket]);
+}
+
+
+void account_wait(object_state *the_object, u64 start_ns) {
+   account_histogram(the_object, WAIT_HISTOGRAM, div_u64(ktime_get_ns() - start_ns, NSEC_PER_USEC));
+}
+
+
+/*
+ * A deferred run drains the writes pending since pending_since, so the latency
+ * recorded is the one of the oldest write of the batch. Called with the
+ * producer lock held.
+ */
+void account_deferred(object_state *the_object, int segments) {
+
+   this_cpu_inc(the_object -> stats -> deferred_runs);
+   this_cpu_add(the_object -> stats -> deferred_segments, segments);
+   // rings queue bytes, not segments
+   if (the_object -> storage != RING_STORAGE)
+      account_histogram(the_object, DEPTH_HISTOGRAM, segments);
+   account_histogram(the_object, VISIBLE_HISTOGRAM,
+      div_u64(ktime_get_ns() - the_object -> pending_since, NSEC_PER_USEC));
+}
+
+
+static void sum_stats(object_state *the_object, flow_stats *sum) {
+
+   int cpu, i;
+   unsigned long *from, *to;
+
+   memset(sum, 0, sizeof(flow_stats));
+
+   for_each_possible_cpu(cpu) {
+      from = (unsigned long *) per_cpu_ptr(the_object -> stats, cpu);
+      to = (unsigned long *) sum;
+      for (i = 0; i < sizeof(flow_stats) / sizeof(unsigned long); i++)
+         to[i] += from[i];
+   }
+}
+
+
+static void show_histogram(struct seq_file *m, const char *name, unsigned long *buckets) {
+
+   int i;
+
+   seq_printf(m, "  %s:", name);
+   for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+      if (buckets[i] != 0)
+         seq_printf(m, " %lu:%lu", 1UL << i, buckets[i]);
+   seq_putc(m, '\n');
+}
+
+
+/*
+ * One entry per flow that has seen any operation since load (or the last
+ * reset). Only allocated minors are listed, minors_lock keeps them from being
+ * freed meanwhile.
+ */
+static int stats_show(struct seq_file *m, void *unused) {
+
+   int j;
+   unsigned long i;
+   flow_stats sum;
+   minor_state *state;
+   object_state *the_object;
+
+   mutex_lock(&minors_lock);
+   xa_for_each(&minors, i, state) {
+      for (j = 0; j < classes; j++) {
+         the_object = &(state -> flows[j]);
+         sum_stats(the_object, &sum);
+
+         if (sum.ops[READ_OP] + sum.ops[WRITE_OP] + sum.eagain + sum.ebusy + sum.etime == 0)
+            continue;
+
+         seq_printf(m, "minor %lu class %d: reads %lu (%lu bytes) writes %lu (%lu bytes) " \
+            "eagain %lu ebusy %lu etime %lu valid %d pending %d waiting %d deferred runs %lu segments %lu\n",
+            i, j,
+            sum.ops[READ_OP], sum.bytes[READ_OP], sum.ops[WRITE_OP], sum.bytes[WRITE_OP],
+            sum.eagain, sum.ebusy, sum.etime,
+            atomic_read(&(the_object -> valid_bytes)), atomic_read(&(the_object -> pending_bytes)),
+            atomic_read(&(the_object -> waiting)), sum.deferred_runs, sum.deferred_segments);
+         show_histogram(m, "wait_us", sum.histograms[WAIT_HISTOGRAM]);
+         show_histogram(m, "visible_us", sum.histograms[VISIBLE_HISTOGRAM]);
+         show_histogram(m, "deferred_depth", sum.histograms[DEPTH_HISTOGRAM]);
+      }
+   }
+   mutex_unlock(&minors_lock);
+
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+
+static void reset_stats(object_state *the_object) {
+
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      memset(per_cpu_ptr(the_object -> stats, cpu), 0, sizeof(flow_stats));
+}
+
+
+// writing a minor number resets every flow of it, a negative one resets every minor
+static ssize_t reset_write(struct file *file, const char __user *buff, size_t len, loff_t *off) {
+
+   int j, minor, ret;
+   unsigned long i;
+   minor_state *state;
+
+   ret = kstrtoint_from_user(buff, len, 10, &minor);
+   if (ret != 0)
+      return ret;
+
+   if (minor >= max_minors)
+      return -EINVAL;
+
+   mutex_lock(&minors_lock);
+   xa_for_each(&minors, i, state) {
+      if (minor >= 0 && i != minor)
+         continue;
+      for (j = 0; j < classes; j++)
+         reset_stats(&(state -> flows[j]));
+   }
+   mutex_unlock(&minors_lock);
+
+   return len;
+}
+
+
+static const struct file_operations reset_fops = {
+   .owner = THIS_MODULE,
+   .write = reset_write,
+};
+
+
+int init_stats_debugfs(void) {
+
+   stats_dir = debugfs_create_dir("multi_flow", NULL);
+   if (IS_ERR_OR_NULL(stats_dir))
+      return -ENODEV;
+
+   debugfs_create_file("stats", 0444, stats_dir, NULL, &stats_fops);
+   debugfs_create_file("reset", 0200, stats_dir, NULL, &reset_fops);
+
+   return 0;
+}
+
+
+void destroy_stats_debugfs(void) {
+   debugfs_remove_recursive(stats_dir);
+   stats_dir = NULL;
+}
+
+
+#endif
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Throughput and latency benchmark of the multi-flow device file.
+ *
+ * Every run drives PRODUCERS writer threads and CONSUMERS reader threads on
+ * each of the selected minors for a number of seconds, each thread with its
+ * own session. Lists of priorities, blocking modes, timeouts and message
+ * sizes are swept: one run (and one output line, CSV or JSON) per combination.
+ *
+ *      sudo ./bench -M 240 -m 0-3 -p 2 -c 2 -s 64,512,4096 -b blocking,nonblocking -T 5
+ *
+ * Latencies are kept in per-thread histograms with 16 linear sub-buckets per
+ * power of two, so percentiles are accurate to about 6%.
+ */
+
+#define MINORS 128
+#define LOW_PRIORITY_CMD 3
+#define HIGH_PRIORITY_CMD 4
+#define BLOCKING_CMD 5
+#define NON_BLOCKING_CMD 6
+#define TIMEOUT_CMD 7
+#define BUSY_POLL_CMD 21
+
+#define MAX_VALUES 16
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+
+enum { LOW, HIGH };
+enum { BLOCKING, NON_BLOCKING };
+enum { E_AGAIN, E_BUSY, E_TIME, E_OTHER, ERRORS };
+
+struct list {
+        long values[MAX_VALUES];
+        int count;
+};
+
+struct config {
+        const char *device;
+        int major;
+        int minors[MINORS];
+        int minors_count;
+        int producers;
+        int consumers;
+        int seconds;
+        int json;
+        int splice;
+        long busy_poll;
+        struct list priorities;
+        struct list blocking;
+        struct list timeouts;
+        struct list sizes;
+};
+
+struct run {
+        int priority;
+        int blocking;
+        long timeout;
+        long size;
+};
+
+struct side_stats {
+        uint64_t ops;
+        uint64_t bytes;
+        uint64_t errors[ERRORS];
+        uint64_t histogram[BUCKETS];
+};
+
+struct worker {
+        pthread_t thread;
+        const struct config *config;
+        const struct run *run;
+        int minor;
+        int writer;
+        struct side_stats stats;
+};
+
+volatile int running;
+pthread_barrier_t start_barrier;
+
+
+
+uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+// values below SUB_BUCKETS get a bucket each, then 16 per power of two
+int bucket_of(uint64_t value) {
+        int exponent;
+
+        if (value < SUB_BUCKETS) return value;
+
+        exponent = 63 - __builtin_clzll(value);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+                ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+
+
+uint64_t bucket_value(int bucket) {
+        int exponent;
+
+        if (bucket < SUB_BUCKETS) return bucket;
+
+        exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        return ((uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS)) << (exponent - SUB_BUCKET_BITS);
+}
+
+
+
+double percentile(const uint64_t *histogram, uint64_t total, double fraction) {
+        uint64_t rank, seen = 0;
+        int i;
+
+        if (total == 0) return 0;
+
+        rank = (uint64_t) (fraction * total);
+        if (rank >= total) rank = total - 1;
+
+        for (i = 0; i < BUCKETS; i++) {
+                seen += histogram[i];
+                if (seen > rank) return bucket_value(i) / 1000.0;
+        }
+        return bucket_value(BUCKETS - 1) / 1000.0;
+}
+
+
+
+int open_session(const struct config *config, const struct run *run, int minor) {
+        char path[256];
+        int fd;
+
+        snprintf(path, sizeof(path), "%s%d", config->device, minor);
+
+        fd = open(path, O_RDWR);
+        if (fd == -1) {
+                fprintf(stderr, "open error on device %s, %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        if (ioctl(fd, run->priority == HIGH ? HIGH_PRIORITY_CMD : LOW_PRIORITY_CMD, 0) == -1 ||
+            ioctl(fd, run->blocking == BLOCKING ? BLOCKING_CMD : NON_BLOCKING_CMD, 0) == -1 ||
+            ioctl(fd, TIMEOUT_CMD, run->timeout) == -1 ||
+            (config->busy_poll > 0 && ioctl(fd, BUSY_POLL_CMD, config->busy_poll) == -1)) {
+                fprintf(stderr, "ioctl error on device %s, %s\n", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+
+
+void *run_worker(void *arg) {
+        struct worker *worker = (struct worker *) arg;
+        struct side_stats *stats = &worker->stats;
+        uint64_t start;
+        ssize_t ret;
+        char *buff;
+        int fd, sink = -1, pipefd[2] = { -1, -1 };
+
+        fd = open_session(worker->config, worker->run, worker->minor);
+        buff = malloc(worker->run->size);
+        if (worker->config->splice && !worker->writer && pipe(pipefd) == 0)
+                sink = open("/dev/null", O_WRONLY);
+
+        pthread_barrier_wait(&start_barrier);
+
+        if (fd == -1 || buff == NULL || (worker->config->splice && !worker->writer && sink == -1)) {
+                stats->errors[E_OTHER]++;
+                goto out;
+        }
+
+        memset(buff, 'x', worker->run->size);
+
+        while (running) {
+                start = now_ns();
+                if (worker->writer) ret = write(fd, buff, worker->run->size);
+                else if (sink == -1) ret = read(fd, buff, worker->run->size);
+                // the flow is drained into a pipe and the pipe into /dev/null, no user copy
+                else if ((ret = splice(fd, NULL, pipefd[1], NULL, worker->run->size, 0)) > 0 &&
+                         splice(pipefd[0], NULL, sink, NULL, ret, 0) != ret) ret = -1;
+
+                if (ret > 0) {
+                        stats->ops++;
+                        stats->bytes += ret;
+                        stats->histogram[bucket_of(now_ns() - start)]++;
+                } else if (errno == EAGAIN) {
+                        stats->errors[E_AGAIN]++;
+                } else if (errno == EBUSY) {
+                        stats->errors[E_BUSY]++;
+                } else if (errno == ETIME) {
+                        stats->errors[E_TIME]++;
+                } else {
+                        stats->errors[E_OTHER]++;
+                }
+        }
+
+out:
+        free(buff);
+        if (fd != -1) close(fd);
+        if (sink != -1) close(sink);
+        if (pipefd[0] != -1) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+        }
+        return NULL;
+}
+
+
+
+void merge(struct side_stats *into, const struct side_stats *from) {
+        int i;
+
+        into->ops += from->ops;
+        into->bytes += from->bytes;
+        for (i = 0; i < ERRORS; i++) into->errors[i] += from->errors[i];
+        for (i = 0; i < BUCKETS; i++) into->histogram[i] += from->histogram[i];
+}
+
+
+
+void report(const struct config *config, const struct run *run, const struct side_stats *sides) {
+        static int header;
+        const char *names[2] = { "read", "write" };
+        const struct side_stats *side;
+        double seconds = config->seconds;
+        int i;
+
+        if (!config->json && !header) {
+                printf("priority,blocking,timeout_ms,size,minors,producers,consumers,seconds");
+                for (i = 0; i < 2; i++)
+                        printf(",%s_ops_s,%s_mb_s,%s_p50_us,%s_p99_us,%s_p999_us,%s_eagain,%s_ebusy,%s_etime,%s_other",
+                                names[i], names[i], names[i], names[i], names[i], names[i], names[i], names[i], names[i]);
+                printf("\n");
+                header = 1;
+        }
+
+        if (config->json)
+                printf("{\"priority\":\"%s\",\"blocking\":\"%s\",\"timeout_ms\":%ld,\"size\":%ld,\"minors\":%d," \
+                        "\"producers\":%d,\"consumers\":%d,\"seconds\":%d",
+                        run->priority == HIGH ? "high" : "low", run->blocking == BLOCKING ? "blocking" : "nonblocking",
+                        run->timeout, run->size, config->minors_count, config->producers, config->consumers, config->seconds);
+        else
+                printf("%s,%s,%ld,%ld,%d,%d,%d,%d",
+                        run->priority == HIGH ? "high" : "low", run->blocking == BLOCKING ? "blocking" : "nonblocking",
+                        run->timeout, run->size, config->minors_count, config->producers, config->consumers, config->seconds);
+
+        for (i = 0; i < 2; i++) {
+                side = &sides[i];
+                if (config->json)
+                        printf(",\"%s\":{\"ops_s\":%.0f,\"mb_s\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f," \
+                                "\"eagain\":%llu,\"ebusy\":%llu,\"etime\":%llu,\"other\":%llu}",
+                                names[i], side->ops / seconds, side->bytes / (1024.0 * 1024.0) / seconds,
+                                percentile(side->histogram, side->ops, 0.5), percentile(side->histogram, side->ops, 0.99),
+                                percentile(side->histogram, side->ops, 0.999),
+                                (unsigned long long) side->errors[E_AGAIN], (unsigned long long) side->errors[E_BUSY],
+                                (unsigned long long) side->errors[E_TIME], (unsigned long long) side->errors[E_OTHER]);
+                else
+                        printf(",%.0f,%.2f,%.2f,%.2f,%.2f,%llu,%llu,%llu,%llu",
+                                side->ops / seconds, side->bytes / (1024.0 * 1024.0) / seconds,
+                                percentile(side->histogram, side->ops, 0.5), percentile(side->histogram, side->ops, 0.99),
+                                percentile(side->histogram, side->ops, 0.999),
+                                (unsigned long long) side->errors[E_AGAIN], (unsigned long long) side->errors[E_BUSY],
+                                (unsigned long long) side->errors[E_TIME], (unsigned long long) side->errors[E_OTHER]);
+        }
+
+        printf(config->json ? "}\n" : "\n");
+        fflush(stdout);
+}
+
+
+
+int benchmark(const struct config *config, const struct run *run) {
+        int threads = config->minors_count * (config->producers + config->consumers);
+        struct side_stats *sides;
+        struct worker *workers;
+        int i, m, t;
+
+        workers = calloc(threads, sizeof(struct worker));
+        sides = calloc(2, sizeof(struct side_stats));
+        if (workers == NULL || sides == NULL) {
+                fprintf(stderr, "unable to allocate %d workers\n", threads);
+                free(workers);
+                free(sides);
+                return -1;
+        }
+
+        running = 1;
+        pthread_barrier_init(&start_barrier, NULL, threads + 1);
+
+        for (i = 0, m = 0; m < config->minors_count; m++) {
+                for (t = 0; t < config->producers + config->consumers; t++, i++) {
+                        workers[i].config = config;
+                        workers[i].run = run;
+                        workers[i].minor = config->minors[m];
+                        workers[i].writer = (t < config->producers);
+                        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+                }
+        }
+
+        pthread_barrier_wait(&start_barrier);
+        sleep(config->seconds);
+        running = 0;
+
+        for (i = 0; i < threads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                merge(&sides[workers[i].writer], &workers[i].stats);
+        }
+
+        pthread_barrier_destroy(&start_barrier);
+
+        report(config, run, sides);
+
+        free(workers);
+        free(sides);
+        return 0;
+}
+
+
+
+// comma separated list of numbers, or of the given names (index in names)
+int parse_list(const char *arg, struct list *list, const char **names) {
+        char *copy, *token, *save;
+        int i;
+
+        list->count = 0;
+        copy = strdup(arg);
+
+        for (token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+                if (list->count == MAX_VALUES) goto error;
+
+                if (names == NULL) {
+                        list->values[list->count++] = strtol(token, NULL, 10);
+                        continue;
+                }
+
+                for (i = 0; names[i] != NULL; i++)
+                        if (strcmp(token, names[i]) == 0) break;
+                if (names[i] == NULL) goto error;
+                list->values[list->count++] = i;
+        }
+
+        free(copy);
+        return list->count > 0 ? 0 : -1;
+
+error:
+        free(copy);
+        return -1;
+}
+
+
+
+// minors as a comma separated list of numbers and ranges, e.g. 0-3,7
+int parse_minors(const char *arg, struct config *config) {
+        char *copy, *token, *save, *dash;
+        int first, last;
+
+        config->minors_count = 0;
+        copy = strdup(arg);
+
+        for (token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+                first = last = strtol(token, NULL, 10);
+                dash = strchr(token, '-');
+                if (dash != NULL) last = strtol(dash + 1, NULL, 10);
+
+                for (; first <= last; first++) {
+                        if (first < 0 || first >= MINORS || config->minors_count == MINORS) {
+                                free(copy);
+                                return -1;
+                        }
+                        config->minors[config->minors_count++] = first;
+                }
+        }
+
+        free(copy);
+        return config->minors_count > 0 ? 0 : -1;
+}
+
+
+
+void usage(void) {
+        printf("Usage: sudo ./bench [options]\n" \
+                "  -d PATH     device file prefix, the minor is appended (default /dev/my-device)\n" \
+                "  -M MAJOR    create the device files of the 128 minors first\n" \
+                "  -m MINORS   minors to use, e.g. 0-3,7 (default 0)\n" \
+                "  -p N        producers per minor (default 1)\n" \
+                "  -c N        consumers per minor (default 1)\n" \
+                "  -P LIST     priorities: high,low (default high)\n" \
+                "  -b LIST     modes: blocking,nonblocking (default blocking)\n" \
+                "  -t LIST     timeouts in millis (default 100)\n" \
+                "  -s LIST     message sizes in bytes (default 64)\n" \
+                "  -T SECONDS  duration of each run (default 5)\n" \
+                "  -B USECS    blocking sessions spin for up to USECS before sleeping (default 0)\n" \
+                "  -S          consumers splice() the flow to /dev/null through a pipe instead of read()\n" \
+                "  -j          JSON lines instead of CSV\n");
+}
+
+
+
+int main(int argc, char **argv) {
+        const char *priorities[] = { "low", "high", NULL };
+        const char *modes[] = { "blocking", "nonblocking", NULL };
+        struct config config;
+        struct run run;
+        char path[256];
+        int opt, i, p, b, t, s;
+
+        memset(&config, 0, sizeof(config));
+        config.device = "/dev/my-device";
+        config.major = -1;
+        config.producers = 1;
+        config.consumers = 1;
+        config.seconds = 5;
+        parse_minors("0", &config);
+        parse_list("high", &config.priorities, priorities);
+        parse_list("blocking", &config.blocking, modes);
+        parse_list("100", &config.timeouts, NULL);
+        parse_list("64", &config.sizes, NULL);
+
+        while ((opt = getopt(argc, argv, "d:M:m:p:c:P:b:t:s:T:B:Sjh")) != -1) {
+                switch (opt) {
+                case 'd': config.device = optarg; break;
+                case 'M': config.major = strtol(optarg, NULL, 10); break;
+                case 'm': if (parse_minors(optarg, &config) != 0) goto invalid; break;
+                case 'p': config.producers = strtol(optarg, NULL, 10); break;
+                case 'c': config.consumers = strtol(optarg, NULL, 10); break;
+                case 'P': if (parse_list(optarg, &config.priorities, priorities) != 0) goto invalid; break;
+                case 'b': if (parse_list(optarg, &config.blocking, modes) != 0) goto invalid; break;
+                case 't': if (parse_list(optarg, &config.timeouts, NULL) != 0) goto invalid; break;
+                case 's': if (parse_list(optarg, &config.sizes, NULL) != 0) goto invalid; break;
+                case 'T': config.seconds = strtol(optarg, NULL, 10); break;
+                case 'B': config.busy_poll = strtol(optarg, NULL, 10); break;
+                case 'S': config.splice = 1; break;
+                case 'j': config.json = 1; break;
+                default: usage(); return opt == 'h' ? 0 : -1;
+                }
+        }
+
+        if (config.producers < 0 || config.consumers < 0 || config.producers + config.consumers == 0 || config.seconds <= 0)
+                goto invalid;
+        for (s = 0; s < config.sizes.count; s++)
+                if (config.sizes.values[s] <= 0) goto invalid;
+
+        if (config.major >= 0) {
+                for (i = 0; i < MINORS; i++) {
+                        snprintf(path, sizeof(path), "%s%d", config.device, i);
+                        if (mknod(path, S_IFCHR | 0666, makedev(config.major, i)) == -1 && errno != EEXIST) {
+                                fprintf(stderr, "mknod error on %s, %s\n", path, strerror(errno));
+                                return -1;
+                        }
+                }
+        }
+
+        for (p = 0; p < config.priorities.count; p++)
+        for (b = 0; b < config.blocking.count; b++)
+        for (t = 0; t < config.timeouts.count; t++)
+        for (s = 0; s < config.sizes.count; s++) {
+                run.priority = config.priorities.values[p];
+                run.blocking = config.blocking.values[b];
+                run.timeout = config.timeouts.values[t];
+                run.size = config.sizes.values[s];
+                if (benchmark(&config, &run) != 0) return -1;
+        }
+
+        return 0;
+
+invalid:
+        usage();
+        return -1;
+}
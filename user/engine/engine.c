@@ -0,0 +1,387 @@
+#include "engine.h"
+#include "../../flow.h"
+#include "../../minors.h"
+#include "../../batch.h"
+
+/*
+ * Each flow is driven through a session of its own, non-blocking with no
+ * timeout: with the shims a wait could only time out at once, see
+ * kernel_shim.h.
+ */
+static session sessions[MINORS][DATA_FLOWS];
+
+static session *engine_session(int minor, int priority, int iovec_segments)
+{
+        sessions[minor][priority].iovec_segments = iovec_segments;
+        return &sessions[minor][priority];
+}
+
+static int valid_flow(int minor, int priority)
+{
+        return minor >= 0 && minor < MINORS && priority >= 0 && priority < classes &&
+                sessions[minor][priority].device != NULL;
+}
+
+static object_state *flow(int minor, int priority)
+{
+        return &sessions[minor][priority].device->flows[priority];
+}
+
+int engine_init(void)
+{
+        if (init_pools() != 0)
+                return -ENOMEM;
+
+        if (init_deferred_queue() != 0) {
+                destroy_pools();
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+void engine_exit(void)
+{
+        engine_drain();
+        destroy_minors();
+        memset(sessions, 0, sizeof(sessions));
+
+        destroy_deferred_queue();
+        destroy_pools();
+}
+
+// every minor is dropped, the classes take effect from the next engine_setup()
+int engine_configure_classes(int count, const int *deferred, const int *weights)
+{
+        int j;
+
+        if (count < 2 || count > DATA_FLOWS)
+                return -EINVAL;
+        for (j = 0; j < count; j++)
+                if (weights[j] < 1)
+                        return -EINVAL;
+
+        engine_drain();
+        destroy_minors();
+        memset(sessions, 0, sizeof(sessions));
+
+        classes = count;
+        for (j = 0; j < count; j++) {
+                class_deferred[j] = deferred[j];
+                class_weight[j] = weights[j];
+        }
+
+        return 0;
+}
+
+int engine_high_class(void)
+{
+        return high_class();
+}
+
+// the state of the minor is rebuilt from its parameters, as on its first open
+int engine_setup(int minor, int storage, int bytes, int split)
+{
+        minor_state *state;
+        int j, k;
+
+        if (minor < 0 || minor >= MINORS || bytes < OBJECT_MAX_SIZE || bytes > MAX_CAPACITY)
+                return -EINVAL;
+
+        // queued runs of the old flows would find them gone
+        engine_drain();
+
+        state = xa_erase(&minors, minor);
+        if (state != NULL)
+                release_minor_state(state);
+
+        ring_mode[minor] = (storage == ENGINE_RING_STORAGE);
+        capacity[minor] = bytes;
+        split_locks[minor] = split;
+        spsc[minor] = 0;
+
+        // the engine holds one session on the minor from now on
+        state = get_minor_state(minor);
+        if (IS_ERR(state)) {
+                memset(sessions[minor], 0, sizeof(sessions[minor]));
+                return PTR_ERR(state);
+        }
+
+        for (j = 0; j < DATA_FLOWS; j++) {
+                memset(&sessions[minor][j], 0, sizeof(session));
+                sessions[minor][j].priority = j;
+                sessions[minor][j].blocking = NON_BLOCKING;
+                for (k = 0; k < DATA_FLOWS; k++) {
+                        INIT_LIST_HEAD(&sessions[minor][j].sequences[k].pending_link);
+                        sessions[minor][j].sequences[k].session = &sessions[minor][j];
+                }
+                sessions[minor][j].device = state;
+        }
+
+        return 0;
+}
+
+ssize_t engine_write(int minor, int priority, const void *buff, size_t len)
+{
+        session *s;
+
+        if (!valid_flow(minor, priority))
+                return -EINVAL;
+
+        s = engine_session(minor, priority, 0);
+        return write_flow(flow(minor, priority), s, buff, len, 0);
+}
+
+ssize_t engine_read(int minor, int priority, void *buff, size_t len)
+{
+        session *s;
+
+        if (!valid_flow(minor, priority))
+                return -EINVAL;
+
+        s = engine_session(minor, priority, 0);
+        return read_flow(flow(minor, priority), s, buff, len, 0);
+}
+
+// splits buff into iovecs vectors of (about) the same length
+static int split_iovecs(struct iovec *iov, void *buff, size_t len, int iovecs)
+{
+        size_t chunk, offset;
+        int i;
+
+        chunk = (len + iovecs - 1) / iovecs;
+        for (i = 0, offset = 0; i < iovecs; i++) {
+                iov[i].iov_base = (char *) buff + offset;
+                iov[i].iov_len = (offset < len) ? MIN(chunk, len - offset) : 0;
+                offset += iov[i].iov_len;
+        }
+
+        return iovecs;
+}
+
+ssize_t engine_writev(int minor, int priority, const void *buff, size_t len, int iovecs, int iovec_segments)
+{
+        session *s;
+        struct iovec iov[iovecs > 0 ? iovecs : 1];
+        struct iov_iter from;
+
+        if (!valid_flow(minor, priority) || iovecs <= 0)
+                return -EINVAL;
+
+        s = engine_session(minor, priority, iovec_segments);
+        iov_iter_init(&from, iov, split_iovecs(iov, (void *) buff, len, iovecs), len);
+        return write_iter_flow(flow(minor, priority), s, NON_BLOCKING, &from, NULL, 0);
+}
+
+int engine_stream_mode(int minor, int priority, int enable)
+{
+        if (!valid_flow(minor, priority))
+                return -EINVAL;
+
+        sessions[minor][priority].stream = (enable != 0);
+        return 0;
+}
+
+int engine_datagram_mode(int minor, int enable)
+{
+        object_state *the_object;
+        int j;
+
+        if (!valid_flow(minor, ENGINE_LOW_PRIORITY))
+                return -EINVAL;
+
+        for (j = 0; j < classes; j++) {
+                the_object = flow(minor, j);
+                if (the_object->storage != SEGMENT_STORAGE)
+                        return -EINVAL;
+                if (atomic_read(&the_object->valid_bytes) != 0 || atomic_read(&the_object->pending_bytes) != 0)
+                        return -EBUSY;
+        }
+
+        for (j = 0; j < classes; j++)
+                flow(minor, j)->datagram = (enable != 0);
+        return 0;
+}
+
+int engine_next_record(int minor, int priority)
+{
+        if (!valid_flow(minor, priority) || !flow(minor, priority)->datagram)
+                return -EINVAL;
+
+        return record_size(flow(minor, priority));
+}
+
+struct engine_iocb {
+        struct kiocb iocb;
+        long *result;
+};
+
+static void engine_complete(struct kiocb *iocb, long ret)
+{
+        struct engine_iocb *request = container_of(iocb, struct engine_iocb, iocb);
+
+        *request->result = ret;
+        free(request);
+}
+
+ssize_t engine_write_async(int minor, int priority, const void *buff, size_t len, long *result)
+{
+        session *s;
+        struct engine_iocb *request;
+        struct iovec iov = { (void *) buff, len };
+        struct iov_iter from;
+        ssize_t ret;
+
+        if (!valid_flow(minor, priority))
+                return -EINVAL;
+
+        request = calloc(1, sizeof(*request));
+        if (request == NULL)
+                return -ENOMEM;
+        request->iocb.ki_complete = engine_complete;
+        request->result = result;
+        *result = -EIOCBQUEUED;
+
+        s = engine_session(minor, priority, 0);
+        iov_iter_init(&from, &iov, 1, len);
+        ret = write_iter_flow(flow(minor, priority), s, NON_BLOCKING, &from, &request->iocb, 0);
+        if (ret != -EIOCBQUEUED)
+                engine_complete(&request->iocb, ret);
+
+        return ret;
+}
+
+ssize_t engine_readv(int minor, int priority, void *buff, size_t len, int iovecs)
+{
+        session *s;
+        struct iovec iov[iovecs > 0 ? iovecs : 1];
+        struct iov_iter to;
+
+        if (!valid_flow(minor, priority) || iovecs <= 0)
+                return -EINVAL;
+
+        s = engine_session(minor, priority, 0);
+        iov_iter_init(&to, iov, split_iovecs(iov, buff, len, iovecs), len);
+        return read_iter_flow(flow(minor, priority), s, NON_BLOCKING, &to, 0);
+}
+
+static ssize_t read_classes(int minor, int read_mode, void *buff, size_t len, int iovecs)
+{
+        session *s;
+        struct iovec iov[iovecs > 0 ? iovecs : 1];
+        struct iov_iter to;
+
+        if (!valid_flow(minor, ENGINE_LOW_PRIORITY) || iovecs < 0)
+                return -EINVAL;
+
+        // the session of class 0 stands for one in COMBINED_READ or DRR_READ mode
+        s = engine_session(minor, ENGINE_LOW_PRIORITY, 0);
+        if (s->read_mode != read_mode) {
+                s->read_mode = read_mode;
+                engine_drr_reset(minor);
+        }
+        if (iovecs == 0)
+                return read_flows(s->device->flows, s, NON_BLOCKING, buff, len, NULL, 0);
+
+        iov_iter_init(&to, iov, split_iovecs(iov, buff, len, iovecs), len);
+        return read_flows(s->device->flows, s, NON_BLOCKING, NULL, 0, &to, 0);
+}
+
+ssize_t engine_read_combined(int minor, void *buff, size_t len, int iovecs)
+{
+        return read_classes(minor, STRICT_PRIORITY, buff, len, iovecs);
+}
+
+ssize_t engine_read_drr(int minor, void *buff, size_t len, int iovecs)
+{
+        return read_classes(minor, DEFICIT_ROUND_ROBIN, buff, len, iovecs);
+}
+
+int engine_drr_reset(int minor)
+{
+        session *s;
+
+        if (!valid_flow(minor, ENGINE_LOW_PRIORITY))
+                return -EINVAL;
+
+        // as DRR_READ does, from the current class
+        s = &sessions[minor][ENGINE_LOW_PRIORITY];
+        memset(s->deficit, 0, sizeof(s->deficit));
+        s->deficit[s->drr_class] = s->device->flows[s->drr_class].weight * DRR_QUANTUM;
+        return 0;
+}
+
+int engine_batch(int minor, struct engine_op *ops, int count)
+{
+        batch_op request[BATCH_MAX];
+        batch argument;
+        long ret;
+        int i;
+
+        if (!valid_flow(minor, ENGINE_LOW_PRIORITY) || count < 0 || count > BATCH_MAX)
+                return -EINVAL;
+
+        for (i = 0; i < count; i++) {
+                request[i].minor = ops[i].minor;
+                request[i].flow = ops[i].priority;
+                request[i].direction = (ops[i].direction == ENGINE_WRITE) ? BATCH_WRITE : BATCH_READ;
+                request[i].flags = 0;
+                request[i].buffer = (uintptr_t) ops[i].buffer;
+                request[i].len = ops[i].len;
+        }
+        argument.ops = (uintptr_t) request;
+        argument.count = count;
+        argument.flags = 0;
+
+        // the session of class 0 stands for the one issuing the ioctl
+        ret = run_batch(&sessions[minor][ENGINE_LOW_PRIORITY], &argument);
+        for (i = 0; i < count && ret >= 0; i++)
+                ops[i].result = request[i].result;
+
+        return ret;
+}
+
+int engine_drain(void)
+{
+        return (deferred_queue != NULL) ? shim_run_work(deferred_queue) : 0;
+}
+
+// over the sessions of the minor: batches write through the one of class 0
+long long engine_write_sequence(int minor, int priority)
+{
+        long long sequence = 0;
+        int j;
+
+        if (!valid_flow(minor, priority))
+                return -EINVAL;
+        for (j = 0; j < classes; j++)
+                sequence += atomic64_read(&sessions[minor][j].sequences[priority].sequence);
+        return sequence;
+}
+
+long long engine_committed_sequence(int minor, int priority)
+{
+        long long committed = 0;
+        int j;
+
+        if (!valid_flow(minor, priority))
+                return -EINVAL;
+        for (j = 0; j < classes; j++)
+                committed += atomic64_read(&sessions[minor][j].sequences[priority].committed);
+        return committed;
+}
+
+int engine_valid_bytes(int minor, int priority)
+{
+        return valid_flow(minor, priority) ? atomic_read(&flow(minor, priority)->valid_bytes) : -EINVAL;
+}
+
+int engine_pending_bytes(int minor, int priority)
+{
+        return valid_flow(minor, priority) ? atomic_read(&flow(minor, priority)->pending_bytes) : -EINVAL;
+}
+
+int engine_capacity(int minor, int priority)
+{
+        return valid_flow(minor, priority) ? flow(minor, priority)->capacity : -EINVAL;
+}
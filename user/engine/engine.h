@@ -0,0 +1,79 @@
+#ifndef _ENGINEH_
+#define _ENGINEH_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * User space build of the flow engine of the multi-flow device file: the same
+ * read and write paths dev_read() and dev_write() run (flow.h), on the flows
+ * of the minor states engine_setup() allocates (minors.h), without loading the
+ * module. A priority is a class, from 0 (ENGINE_LOW_PRIORITY) up to the
+ * classes configured.
+ */
+
+#define ENGINE_LOW_PRIORITY 0
+#define ENGINE_SEGMENT_STORAGE 0
+#define ENGINE_RING_STORAGE 1
+#define ENGINE_READ 0
+#define ENGINE_WRITE 1
+
+int engine_init(void);
+void engine_exit(void);
+
+// classes of every minor, with their deferred flags and DRR weights (2 classes by default), see classes
+int engine_configure_classes(int count, const int *deferred, const int *weights);
+
+// the highest class configured, the one of the high priority ioctl
+int engine_high_class(void);
+
+// (re)initializes every flow of a minor, dropping their content
+int engine_setup(int minor, int storage, int capacity, int split_locks);
+
+ssize_t engine_write(int minor, int priority, const void *buff, size_t len);
+ssize_t engine_read(int minor, int priority, void *buff, size_t len);
+ssize_t engine_writev(int minor, int priority, const void *buff, size_t len, int iovecs, int iovec_segments);
+ssize_t engine_readv(int minor, int priority, void *buff, size_t len, int iovecs);
+// highest class first, down to class 0, see COMBINED_READ; readv() with iovecs > 0
+ssize_t engine_read_combined(int minor, void *buff, size_t len, int iovecs);
+// deficit round robin over the classes by weight, see DRR_READ; readv() with iovecs > 0
+ssize_t engine_read_drr(int minor, void *buff, size_t len, int iovecs);
+// a new DRR round from the current class, as a DRR_READ ioctl
+int engine_drr_reset(int minor);
+
+// small engine_write() calls of the flow are packed into its last segment, see STREAM_MODE
+int engine_stream_mode(int minor, int priority, int enable);
+
+// both (empty) segment flows of the minor switch to records, see DATAGRAM_MODE
+int engine_datagram_mode(int minor, int enable);
+// size of the next record of the flow, see NEXT_RECORD_SIZE
+int engine_next_record(int minor, int priority);
+
+// one operation of engine_batch(): result is set to the bytes read or written, or -errno
+struct engine_op {
+        int minor;
+        int priority;
+        int direction;                          // ENGINE_READ or ENGINE_WRITE
+        void *buffer;
+        size_t len;
+        long long result;
+};
+
+// runs the operations in a single BATCH ioctl issued on minor, returns the number run
+int engine_batch(int minor, struct engine_op *ops, int count);
+
+// io_uring/AIO-like write: *result is set on completion, the return value is -EIOCBQUEUED until then
+ssize_t engine_write_async(int minor, int priority, const void *buff, size_t len, long *result);
+
+// runs the deferred writes queued so far, returns the number of runs
+int engine_drain(void);
+
+// sequence numbers of the deferred writes on the flow, over every session, see WRITE_SEQUENCE
+long long engine_write_sequence(int minor, int priority);
+long long engine_committed_sequence(int minor, int priority);
+
+int engine_valid_bytes(int minor, int priority);
+int engine_pending_bytes(int minor, int priority);
+int engine_capacity(int minor, int priority);
+
+#endif
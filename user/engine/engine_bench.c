@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "engine.h"
+
+/*
+ * Microbenchmark of the flow engine, without the module: a write and the read
+ * draining it, in a loop, for each storage mode, priority and message size.
+ * Low priority writes are made visible by running the deferred work after
+ * each one, so their figures include a deferred run.
+ *
+ *      ./engine_bench [-n iterations] [-c capacity] [-v iovecs] [-l] [-s]
+ *
+ * -v goes through writev()/readv() with that many iovecs per call, -l uses
+ * split locks, -s puts the flows in stream mode. One CSV line per
+ * combination, times in ns per write+read.
+ */
+
+static const size_t sizes[] = { 16, 64, 512, 4096, 16384 };
+
+static double now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int run(int storage, int priority, size_t size, long iterations, int capacity, int iovecs, int split_locks,
+        int stream, double *ns)
+{
+        char *in, *out;
+        double start;
+        ssize_t ret;
+        long i;
+
+        if (size > (size_t) capacity)
+                return 1;
+
+        if (engine_setup(0, storage, capacity, split_locks) != 0 || engine_stream_mode(0, priority, stream) != 0) {
+                fprintf(stderr, "engine_setup failed\n");
+                return -1;
+        }
+
+        in = malloc(size);
+        out = malloc(size);
+        if (in == NULL || out == NULL) {
+                free(in);
+                free(out);
+                return -1;
+        }
+        memset(in, 'x', size);
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+                ret = iovecs ? engine_writev(0, priority, in, size, iovecs, 0) : engine_write(0, priority, in, size);
+                if (ret != (ssize_t) size)
+                        break;
+                if (priority == ENGINE_LOW_PRIORITY)
+                        engine_drain();
+                ret = iovecs ? engine_readv(0, priority, out, size, iovecs) : engine_read(0, priority, out, size);
+                if (ret != (ssize_t) size)
+                        break;
+        }
+        *ns = (now_ns() - start) / iterations;
+
+        free(in);
+        free(out);
+
+        if (i < iterations) {
+                fprintf(stderr, "iteration %ld: unexpected return %zd\n", i, ret);
+                return -1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        long iterations = 1000000;
+        int capacity = 1 << 20, iovecs = 0, split_locks = 0, stream = 0;
+        int storage, priorities[2], priority, p, opt, ret;
+        size_t s;
+        double ns;
+
+        while ((opt = getopt(argc, argv, "n:c:v:ls")) != -1) {
+                switch (opt) {
+                case 'n':
+                        iterations = atol(optarg);
+                        break;
+                case 'c':
+                        capacity = atoi(optarg);
+                        break;
+                case 'v':
+                        iovecs = atoi(optarg);
+                        break;
+                case 'l':
+                        split_locks = 1;
+                        break;
+                case 's':
+                        stream = 1;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n iterations] [-c capacity] [-v iovecs] [-l] [-s]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (iterations <= 0 || iovecs < 0 || engine_init() != 0)
+                return EXIT_FAILURE;
+
+        // the highest class and the lowest one
+        priorities[0] = engine_high_class();
+        priorities[1] = ENGINE_LOW_PRIORITY;
+
+        printf("storage,priority,size,iovecs,split_locks,stream,ns_per_op\n");
+        for (storage = ENGINE_SEGMENT_STORAGE; storage <= ENGINE_RING_STORAGE; storage++) {
+                for (p = 0; p < 2; p++) {
+                        priority = priorities[p];
+                        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                                ret = run(storage, priority, sizes[s], iterations, capacity, iovecs, split_locks, stream, &ns);
+                                if (ret < 0) {
+                                        engine_exit();
+                                        return EXIT_FAILURE;
+                                }
+                                if (ret > 0)
+                                        continue;
+                                printf("%s,%s,%zu,%d,%d,%d,%.1f\n",
+                                        storage == ENGINE_RING_STORAGE ? "ring" : "segment",
+                                        priority == ENGINE_LOW_PRIORITY ? "low" : "high",
+                                        sizes[s], iovecs, split_locks, stream, ns);
+                        }
+                }
+        }
+
+        engine_exit();
+        return EXIT_SUCCESS;
+}
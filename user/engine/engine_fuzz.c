@@ -0,0 +1,615 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "engine.h"
+
+/*
+ * Fuzz driver of the flow engine: the input is a flow configuration (with 2
+ * or 3 classes, each one deferred or not and with its DRR weight) followed
+ * by a sequence of reads, writes, readv/writev, asynchronous writes and
+ * deferred runs on the flows of a minor, checked against a shadow FIFO per
+ * flow. Every byte read must be the next one written to that flow, the valid
+ * and pending bytes of the engine must match the model after each operation,
+ * asynchronous writes must complete with their size on the next run, and
+ * the sequence numbers of the deferred writes must be committed by it. Both
+ * flows may be in stream mode, packing small writes into their last segment,
+ * and segment flows may be in datagram mode, where the model also keeps the
+ * records: each write must be one whole record (one per iovec with
+ * per_iovec), and each read must return whole records. Combined reads must
+ * drain the classes from the highest one down, DRR reads must take them in
+ * the order and the amounts of the deficit round robin the model replays.
+ * Batches mix reads and writes on random classes (and a few invalid ones),
+ * which the model replays in the order the engine groups them by flow.
+ *
+ * Built with -DLIBFUZZER it is a libFuzzer target (make fuzz), otherwise a
+ * standalone driver (make asan) running the files given on the command line,
+ * or random inputs when there are none:
+ *
+ *      ./engine_fuzz_asan [-n runs] [file...]
+ */
+
+#define MAX_OP_LEN 20000
+#define CAPACITIES 4
+#define MAX_CLASSES 3
+#define QUANTUM 1024                            // DRR_QUANTUM
+
+#define MAX_BATCH 8
+#define MAX_BATCH_LEN 5000
+
+enum { OP_WRITE, OP_READ, OP_WRITEV, OP_READV, OP_DRAIN, OP_WRITE_ASYNC, OP_READ_BOTH, OP_READ_DRR, OP_BATCH, OPS };
+enum { READ_FLOW, READ_COMBINED, READ_DRR };
+
+static const int capacities[CAPACITIES] = { 4096, 8192, 65536, 4096 * 3 };
+
+struct shadow {
+        unsigned char *bytes;                   // written bytes not read yet, visible ones first
+        size_t visible;
+        size_t pending;                         // deferred bytes waiting for a deferred run
+        unsigned char next;                     // value of the next byte written
+        long long sequence;                     // deferred writes so far
+        long long committed;                    // deferred writes made visible
+        size_t *records;                        // datagram mode: sizes of the records not read yet, visible ones first
+        size_t nrecords;
+        size_t visible_records;
+};
+
+struct async_write {
+        long result;                            // set by the engine on completion
+        long expected;
+};
+
+static unsigned char in[MAX_OP_LEN], out[MAX_OP_LEN];
+static int datagram, classes, deferred[MAX_CLASSES], weights[MAX_CLASSES];
+static int read_mode, drr_class, deficit[MAX_CLASSES];         // as in the session reading the classes
+
+static void check(int condition, const char *what)
+{
+        if (!condition) {
+                fprintf(stderr, "engine_fuzz: %s\n", what);
+                abort();
+        }
+}
+
+static void check_flow(struct shadow *flow, int priority)
+{
+        check(engine_valid_bytes(0, priority) == (int) flow->visible, "valid bytes differ from the model");
+        check(engine_pending_bytes(0, priority) == (int) flow->pending, "pending bytes differ from the model");
+        check(flow->visible + flow->pending <= (size_t) engine_capacity(0, priority), "flow above capacity");
+        check(engine_write_sequence(0, priority) == flow->sequence, "write sequence differs from the model");
+        check(engine_committed_sequence(0, priority) == flow->committed, "committed sequence differs from the model");
+        if (datagram)
+                check(engine_next_record(0, priority) == (int) (flow->visible_records ? flow->records[0] : 0),
+                        "next record size differs from the model");
+}
+
+// lengths of the iovecs engine_writev()/engine_readv() split len bytes into
+static void iovec_lengths(size_t *lengths, size_t len, int iovecs)
+{
+        size_t chunk, offset;
+        int i;
+
+        chunk = (len + iovecs - 1) / iovecs;
+        for (i = 0, offset = 0; i < iovecs; i++) {
+                lengths[i] = (offset < len) ? (chunk < len - offset ? chunk : len - offset) : 0;
+                offset += lengths[i];
+        }
+}
+
+static void push_records(struct shadow *flow, size_t len, int iovecs, int per_iovec)
+{
+        size_t lengths[8];
+        int i;
+
+        if (!iovecs || !per_iovec) {
+                flow->records[flow->nrecords++] = len;
+                return;
+        }
+
+        iovec_lengths(lengths, len, iovecs);
+        for (i = 0; i < iovecs; i++)
+                if (lengths[i] > 0)
+                        flow->records[flow->nrecords++] = lengths[i];
+}
+
+static void check_write(struct shadow *flow, int priority, const unsigned char *buff, size_t len, int iovecs,
+        int per_iovec, ssize_t ret);
+
+static void do_write(struct shadow *flow, int priority, size_t len, int iovecs, int per_iovec,
+        struct async_write *async)
+{
+        ssize_t ret;
+        size_t i;
+        int pending;
+
+        for (i = 0; i < len; i++)
+                in[i] = flow->next + i;
+
+        pending = engine_pending_bytes(0, priority);
+        if (async != NULL) {
+                ret = engine_write_async(0, priority, in, len, &async->result);
+                // queued writes only tell their size on completion
+                if (ret == -EIOCBQUEUED) {
+                        check(deferred[priority], "synchronous write queued");
+                        ret = engine_pending_bytes(0, priority) - pending;
+                        check(ret > 0, "empty write queued");
+                        async->expected = ret;
+                } else {
+                        check(async->result == ret, "synchronous completion differs from the return value");
+                        async->result = async->expected = 0;
+                }
+        } else {
+                ret = iovecs ? engine_writev(0, priority, in, len, iovecs, per_iovec) : engine_write(0, priority, in, len);
+        }
+        check_write(flow, priority, in, len, iovecs, per_iovec, ret);
+}
+
+// the model takes the ret bytes of buff an engine write of len bytes returned
+static void check_write(struct shadow *flow, int priority, const unsigned char *buff, size_t len, int iovecs,
+        int per_iovec, ssize_t ret)
+{
+        if (datagram) {
+                if (len > (size_t) engine_capacity(0, priority))
+                        check(ret == -EMSGSIZE, "record larger than the flow accepted");
+                else if (flow->visible + flow->pending + len > (size_t) engine_capacity(0, priority))
+                        check(ret == -EAGAIN, "record accepted without room for it");
+                else
+                        check(ret == (ssize_t) len, "record not written whole");
+                if (ret > 0)
+                        push_records(flow, ret, iovecs, per_iovec);
+                if (ret > 0 && !deferred[priority])
+                        flow->visible_records = flow->nrecords;
+        }
+        if (ret < 0) {
+                check(ret == -EAGAIN || len == 0 || datagram, "unexpected write error");
+                return;
+        }
+        check((size_t) ret <= len, "wrote more than asked");
+
+        memcpy(flow->bytes + flow->visible + flow->pending, buff, ret);
+        if (!deferred[priority]) {
+                flow->visible += ret;
+        } else {
+                flow->pending += ret;
+                flow->sequence += (ret > 0);
+        }
+        flow->next += ret;
+}
+
+static void drop_bytes(struct shadow *flow, size_t bytes)
+{
+        memmove(flow->bytes, flow->bytes + bytes, flow->visible + flow->pending - bytes);
+        flow->visible -= bytes;
+}
+
+static ssize_t read_classes(int mode, size_t len, int iovecs)
+{
+        return (mode == READ_DRR) ? engine_read_drr(0, out, len, iovecs) : engine_read_combined(0, out, len, iovecs);
+}
+
+// one record per iovec, while the next one fits the next iovec
+static void check_records(struct shadow *flow, const unsigned char *buff, size_t len, int iovecs, ssize_t ret)
+{
+        size_t lengths[8], offset, records, bytes;
+        int i;
+
+        if (iovecs)
+                iovec_lengths(lengths, len, iovecs);
+        else
+                lengths[0] = len;
+
+        if (len == 0) {
+                check(ret == 0, "empty read returned something");
+                return;
+        }
+
+        bytes = 0;
+        offset = 0;
+        for (i = 0, records = 0; i < (iovecs ? iovecs : 1) && records < flow->visible_records; i++) {
+                if (flow->records[records] > lengths[i])
+                        break;
+                check(memcmp(buff + offset, flow->bytes + bytes, flow->records[records]) == 0, "record read out of FIFO order");
+                bytes += flow->records[records++];
+                offset += lengths[i];
+        }
+
+        if (records == 0) {
+                check(ret == (flow->visible_records ? -EMSGSIZE : -EAGAIN), "unexpected read error");
+                return;
+        }
+        check(ret == (ssize_t) bytes, "records read differ from the model");
+
+        drop_bytes(flow, bytes);
+        memmove(flow->records, flow->records + records, (flow->nrecords - records) * sizeof(size_t));
+        flow->nrecords -= records;
+        flow->visible_records -= records;
+}
+
+static ssize_t do_read_records(struct shadow *flow, int priority, size_t len, int iovecs, int mode)
+{
+        ssize_t ret;
+
+        if (mode != READ_FLOW)
+                ret = read_classes(mode, len, iovecs);
+        else
+                ret = iovecs ? engine_readv(0, priority, out, len, iovecs) : engine_read(0, priority, out, len);
+        check_records(flow, out, len, iovecs, ret);
+        return ret;
+}
+
+// the model gives the bytes an engine read of len bytes into buff returned
+static void check_read(struct shadow *flow, const unsigned char *buff, size_t len, ssize_t ret)
+{
+        if (datagram) {
+                check_records(flow, buff, len, 0, ret);
+                return;
+        }
+
+        if (ret < 0) {
+                check(ret == -EAGAIN && flow->visible == 0, "unexpected read error");
+                return;
+        }
+        check((size_t) ret == (len < flow->visible ? len : flow->visible), "short or long read");
+        check(memcmp(buff, flow->bytes, ret) == 0, "read bytes out of FIFO order");
+
+        drop_bytes(flow, ret);
+}
+
+static void do_read(struct shadow *flow, int priority, size_t len, int iovecs)
+{
+        ssize_t ret;
+
+        if (datagram) {
+                do_read_records(flow, priority, len, iovecs, READ_FLOW);
+                return;
+        }
+
+        ret = iovecs ? engine_readv(0, priority, out, len, iovecs) : engine_read(0, priority, out, len);
+        check_read(flow, out, len, ret);
+}
+
+// the session switching to mode starts a new DRR round, see engine_read_drr()
+static void set_read_mode(int mode)
+{
+        if (read_mode == mode)
+                return;
+        read_mode = mode;
+        memset(deficit, 0, sizeof(deficit));
+        deficit[drr_class] = weights[drr_class] * QUANTUM;
+}
+
+// highest class first, down to class 0; whole records of one flow in datagram mode
+static void do_read_combined(struct shadow *flows, size_t len, int iovecs)
+{
+        size_t bytes, read;
+        ssize_t ret;
+        int c;
+
+        set_read_mode(READ_COMBINED);
+        if (datagram) {
+                for (c = classes - 1; c > 0 && flows[c].visible_records == 0; c--)
+                        ;
+                do_read_records(&flows[c], c, len, iovecs, READ_COMBINED);
+                return;
+        }
+
+        ret = engine_read_combined(0, out, len, iovecs);
+        for (c = classes - 1, read = 0; c >= 0; c--) {
+                bytes = len - read < flows[c].visible ? len - read : flows[c].visible;
+                check(memcmp(out + read, flows[c].bytes, bytes) == 0, "combined read out of FIFO order");
+                drop_bytes(&flows[c], bytes);
+                read += bytes;
+        }
+        if (read == 0)
+                check(ret == (len ? -EAGAIN : 0), "unexpected combined read error");
+        else
+                check(ret == (ssize_t) read, "short or long combined read");
+}
+
+// the turn of the class whose deficit is spent, or which is empty, passes to the next one
+static int next_turn(struct shadow *flows, int *idle)
+{
+        if (flows[drr_class].visible == 0) {
+                deficit[drr_class] = 0;
+                if (++*idle == classes)
+                        return 0;
+        } else {
+                *idle = 0;
+        }
+
+        drr_class = (drr_class + 1) % classes;
+        deficit[drr_class] += weights[drr_class] * QUANTUM;
+        return 1;
+}
+
+// deficit round robin over the classes, replayed on the model; a record may overdraw the deficit
+static void do_read_drr(struct shadow *flows, size_t len, int iovecs)
+{
+        size_t bytes, read = 0;
+        ssize_t ret;
+        int c, idle = 0;
+
+        set_read_mode(READ_DRR);
+        if (len == 0) {
+                check(engine_read_drr(0, out, len, iovecs) == 0, "empty read returned something");
+                return;
+        }
+
+        if (datagram) {
+                do {
+                        c = drr_class;
+                        if (deficit[c] > 0 && flows[c].visible_records > 0) {
+                                ret = do_read_records(&flows[c], c, len, iovecs, READ_DRR);
+                                if (ret > 0)
+                                        deficit[c] -= ret;
+                                return;
+                        }
+                } while (next_turn(flows, &idle));
+                do_read_records(&flows[0], 0, len, iovecs, READ_DRR);
+                return;
+        }
+
+        ret = engine_read_drr(0, out, len, iovecs);
+        while (read < len) {
+                c = drr_class;
+                if (deficit[c] > 0 && flows[c].visible > 0) {
+                        bytes = len - read < flows[c].visible ? len - read : flows[c].visible;
+                        bytes = bytes < (size_t) deficit[c] ? bytes : (size_t) deficit[c];
+                        check(memcmp(out + read, flows[c].bytes, bytes) == 0, "DRR read out of FIFO order");
+                        drop_bytes(&flows[c], bytes);
+                        deficit[c] -= bytes;
+                        read += bytes;
+                        idle = 0;
+                        continue;
+                }
+                if (!next_turn(flows, &idle))
+                        break;
+        }
+        if (read == 0)
+                check(ret == -EAGAIN, "unexpected DRR read error");
+        else
+                check(ret == (ssize_t) read, "short or long DRR read");
+}
+
+static int same_flow(struct engine_op *op, struct engine_op *other)
+{
+        return op->priority == other->priority;
+}
+
+// count operations drawn from seed, in a single batch
+static void do_batch(struct shadow *flows, unsigned int seed, int count)
+{
+        static unsigned char buffers[MAX_BATCH][MAX_BATCH_LEN];
+        struct engine_op ops[MAX_BATCH];
+        int order[MAX_BATCH], placed[MAX_BATCH] = { 0 }, i, j, n;
+        struct engine_op *op;
+        size_t b;
+
+        for (i = 0; i < count; i++) {
+                seed = seed * 1103515245 + 12345;
+                op = &ops[i];
+                op->minor = 0;
+                op->priority = ((seed >> 28) == 15) ? classes : (int) ((seed >> 16) % classes);
+                op->direction = (seed >> 24) & 1 ? ENGINE_WRITE : ENGINE_READ;
+                op->buffer = buffers[i];
+                op->len = (seed >> 8) % MAX_BATCH_LEN;
+                for (b = 0; op->direction == ENGINE_WRITE && b < op->len; b++)
+                        buffers[i][b] = seed + b;
+        }
+
+        check(engine_batch(0, ops, count) == count, "batch not run whole");
+
+        // the groups of operations on the same flow run in the order of their first operation
+        for (i = 0, n = 0; i < count; i++) {
+                if (placed[i])
+                        continue;
+                for (j = i; j < count; j++)
+                        if (!placed[j] && same_flow(&ops[i], &ops[j])) {
+                                order[n++] = j;
+                                placed[j] = 1;
+                        }
+        }
+
+        for (i = 0; i < n; i++) {
+                op = &ops[order[i]];
+                if (op->priority == classes) {
+                        check(op->result == -EINVAL, "batch operation on no flow run");
+                        continue;
+                }
+                if (op->direction == ENGINE_WRITE)
+                        check_write(&flows[op->priority], op->priority, op->buffer, op->len, 0, 0, op->result);
+                else
+                        check_read(&flows[op->priority], op->buffer, op->len, op->result);
+        }
+}
+
+static void check_completions(struct async_write *async, int count)
+{
+        int i;
+
+        for (i = 0; i < count; i++)
+                check(async[i].result == async[i].expected, "asynchronous write not completed with its size");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+        static int initialized;
+        struct shadow flows[MAX_CLASSES];
+        struct async_write *async;
+        int storage, split_locks, capacity, stream, priority, op, iovecs, per_iovec, asyncs, c;
+        size_t i, len;
+
+        if (!initialized) {
+                if (engine_init() != 0)
+                        abort();
+                initialized = 1;
+        }
+
+        if (size < 2)
+                return 0;
+
+        // classes, then which are deferred and their weights (1 or 3)
+        classes = 2 + (data[1] & 1);
+        for (c = 0; c < classes; c++) {
+                deferred[c] = (data[1] >> (1 + c)) & 1;
+                weights[c] = 1 + 2 * ((data[1] >> (4 + c)) & 1);
+        }
+        if (engine_configure_classes(classes, deferred, weights) != 0)
+                abort();
+        read_mode = READ_FLOW;
+        drr_class = 0;
+        memset(deficit, 0, sizeof(deficit));
+
+        storage = data[0] & 1 ? ENGINE_RING_STORAGE : ENGINE_SEGMENT_STORAGE;
+        split_locks = (data[0] >> 1) & 1;
+        capacity = capacities[(data[0] >> 2) % CAPACITIES];
+        stream = (data[0] >> 4) & 1;
+        datagram = (data[0] >> 5) & 1 && storage == ENGINE_SEGMENT_STORAGE;
+        if (engine_setup(0, storage, capacity, split_locks) != 0)
+                abort();
+        if (storage == ENGINE_SEGMENT_STORAGE && engine_datagram_mode(0, datagram) != 0)
+                abort();
+        for (priority = 0; priority < classes; priority++)
+                if (engine_stream_mode(0, priority, stream) != 0)
+                        abort();
+
+        async = calloc(size / 3 + 1, sizeof(struct async_write));
+        check(async != NULL, "out of memory");
+        asyncs = 0;
+
+        memset(flows, 0, sizeof(flows));
+        for (priority = 0; priority < classes; priority++) {
+                flows[priority].bytes = malloc(capacity);
+                flows[priority].records = malloc(capacity * sizeof(size_t));
+                check(flows[priority].bytes != NULL && flows[priority].records != NULL, "out of memory");
+        }
+
+        // each operation takes three bytes: kind, class and iovecs, then class, per_iovec and length
+        for (i = 2; i + 3 <= size; i += 3) {
+                op = ((data[i] & 7) | (data[i] >> 7) << 3) % OPS;
+                priority = ((data[i + 1] >> 7) << 1 | ((data[i] >> 3) & 1)) % classes;
+                iovecs = (data[i] >> 4) & 7;
+                per_iovec = (data[i + 1] >> 6) & 1;
+                len = ((size_t) (data[i + 1] & 0x3f) << 8 | data[i + 2]) % MAX_OP_LEN;
+
+                switch (op) {
+                case OP_WRITE:
+                        do_write(&flows[priority], priority, len, 0, 0, NULL);
+                        break;
+                case OP_WRITEV:
+                        do_write(&flows[priority], priority, len, iovecs + 1, per_iovec, NULL);
+                        break;
+                case OP_WRITE_ASYNC:
+                        do_write(&flows[priority], priority, len, 0, 0, &async[asyncs++]);
+                        break;
+                case OP_READ:
+                        do_read(&flows[priority], priority, len, 0);
+                        break;
+                case OP_READV:
+                        do_read(&flows[priority], priority, len, iovecs + 1);
+                        break;
+                case OP_READ_BOTH:
+                        do_read_combined(flows, len, iovecs);
+                        break;
+                case OP_READ_DRR:
+                        do_read_drr(flows, len, iovecs);
+                        break;
+                case OP_BATCH:
+                        do_batch(flows, data[i + 1] << 8 | data[i + 2], iovecs + 1);
+                        break;
+                case OP_DRAIN:
+                        engine_drain();
+                        for (c = 0; c < classes; c++) {
+                                if (!deferred[c])
+                                        continue;
+                                flows[c].visible += flows[c].pending;
+                                flows[c].pending = 0;
+                                flows[c].committed = flows[c].sequence;
+                                flows[c].visible_records = flows[c].nrecords;
+                        }
+                        check_completions(async, asyncs);
+                        break;
+                }
+
+                for (c = 0; c < classes; c++)
+                        check_flow(&flows[c], c);
+        }
+
+        // writes still queued complete on this last run
+        engine_drain();
+        check_completions(async, asyncs);
+
+        free(async);
+        for (priority = 0; priority < classes; priority++) {
+                free(flows[priority].bytes);
+                free(flows[priority].records);
+        }
+        return 0;
+}
+
+#ifndef LIBFUZZER
+
+static int run_file(const char *path)
+{
+        unsigned char *data;
+        FILE *file;
+        long size;
+
+        file = fopen(path, "rb");
+        if (file == NULL) {
+                perror(path);
+                return -1;
+        }
+        fseek(file, 0, SEEK_END);
+        size = ftell(file);
+        rewind(file);
+
+        data = malloc(size > 0 ? size : 1);
+        if (data == NULL || fread(data, 1, size, file) != (size_t) size) {
+                fclose(file);
+                free(data);
+                return -1;
+        }
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        unsigned char data[2 + 3 * 256];
+        long runs = 10000, r;
+        size_t i, size;
+        int first = 1;
+
+        if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+                runs = atol(argv[2]);
+                first = 3;
+        }
+
+        if (first < argc) {
+                for (; first < argc; first++)
+                        if (run_file(argv[first]) != 0)
+                                return EXIT_FAILURE;
+                return EXIT_SUCCESS;
+        }
+
+        srand(1);
+        for (r = 0; r < runs; r++) {
+                size = 2 + 3 * (rand() % 256);
+                for (i = 0; i < size; i++)
+                        data[i] = rand();
+                // mostly short operations, so that flows fill and drain often
+                for (i = 3; i < size; i += 3)
+                        data[i] &= (rand() & 1) ? 0xcf : 0xff;
+                LLVMFuzzerTestOneInput(data, size);
+        }
+
+        printf("%ld random inputs run\n", runs);
+        return EXIT_SUCCESS;
+}
+
+#endif
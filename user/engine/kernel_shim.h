@@ -0,0 +1,452 @@
+#ifndef _KERNEL_SHIMH_
+#define _KERNEL_SHIMH_
+
+/*
+ * Thin user space stand-ins for the kernel services used by the flow engine
+ * (info.h, ring.h, pool.h, read.h, write.h, blocking.h, stats.h and flow.h),
+ * so that it can be built as a plain library. The Makefile generates one
+ * linux/<name>.h per kernel header the engine includes, each of them just
+ * including this file.
+ *
+ * The engine is driven by a single thread: mutexes are real, wait queues are
+ * no-ops and a blocking wait times out at once, deferred work is queued and
+ * only runs in engine_drain().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* the engine's read() and write() must not clash with the libc ones */
+#define read flow_engine_read
+#define write flow_engine_write
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef int64_t __s64;
+typedef unsigned int gfp_t;
+typedef unsigned int __poll_t;
+
+#define __user
+#define __percpu
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define swap(a, b) do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define ilog2(n) (63 - __builtin_clzll(n))
+
+#ifndef ERESTARTSYS
+#define ERESTARTSYS 512
+#endif
+#ifndef EIOCBQUEUED
+#define EIOCBQUEUED 529
+#endif
+
+/* module */
+
+#define THIS_MODULE NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm) static void *__param_##name __attribute__((unused)) = &name
+#define module_param_array(name, type, n, perm) static void *__param_##name __attribute__((unused)) = &name
+#define module_param_cb(name, ops, arg, perm) static const void *__param_##name __attribute__((unused)) = (ops)
+#define printk(...) ((void) 0)
+#define KERN_INFO ""
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 8, 0)
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+
+static inline int try_module_get(void *module) { return 1; }
+static inline void module_put(void *module) { }
+
+struct kernel_param;
+struct kernel_param_ops {
+        int (*set)(const char *, const struct kernel_param *);
+        int (*get)(char *, const struct kernel_param *);
+};
+static inline int param_set_bool(const char *val, const struct kernel_param *kp) { return 0; }
+static inline int param_get_bool(char *buffer, const struct kernel_param *kp) { return 0; }
+
+struct static_key_false { bool enabled; };
+#define DEFINE_STATIC_KEY_FALSE(name) struct static_key_false name = { false }
+#define static_branch_unlikely(key) unlikely((key)->enabled)
+#define static_branch_enable(key) ((key)->enabled = true)
+#define static_branch_disable(key) ((key)->enabled = false)
+
+struct task_struct { int pid; };
+static struct task_struct shim_task;
+#define current (&shim_task)
+
+/* memory ordering and atomics */
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *) &(x) = (v))
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_mb__before_atomic() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_mb__after_atomic() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef struct { int counter; } atomic_t;
+
+static inline int atomic_read(const atomic_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }
+static inline int atomic_read_acquire(const atomic_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_ACQUIRE); }
+static inline void atomic_set(atomic_t *v, int i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }
+static inline void atomic_set_release(atomic_t *v, int i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELEASE); }
+static inline void atomic_add(int i, atomic_t *v) { __atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED); }
+static inline void atomic_sub(int i, atomic_t *v) { __atomic_fetch_sub(&v->counter, i, __ATOMIC_RELAXED); }
+static inline void atomic_inc(atomic_t *v) { atomic_add(1, v); }
+static inline void atomic_dec(atomic_t *v) { atomic_sub(1, v); }
+static inline int atomic_add_return(int i, atomic_t *v) { return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }
+static inline int atomic_sub_return(int i, atomic_t *v) { return __atomic_sub_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }
+static inline int atomic_inc_return(atomic_t *v) { return atomic_add_return(1, v); }
+static inline int atomic_dec_and_test(atomic_t *v) { return atomic_sub_return(1, v) == 0; }
+static inline int atomic_xchg(atomic_t *v, int i) { return __atomic_exchange_n(&v->counter, i, __ATOMIC_SEQ_CST); }
+#define xchg(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+        __atomic_compare_exchange_n(&v->counter, &old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return old;
+}
+
+typedef struct { long long counter; } atomic64_t;
+
+static inline long long atomic64_read(const atomic64_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }
+static inline void atomic64_set(atomic64_t *v, long long i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }
+static inline void atomic64_inc(atomic64_t *v) { __atomic_fetch_add(&v->counter, 1, __ATOMIC_RELAXED); }
+
+/* errors in pointers */
+
+#define ERR_PTR(error) ((void *) (long) (error))
+#define IS_ERR(p) ((unsigned long) (p) > (unsigned long) -4096)
+#define PTR_ERR(p) ((long) (p))
+
+/* lists and a flat xarray */
+
+struct list_head { struct list_head *next, *prev; };
+#define INIT_LIST_HEAD(list) do { (list)->next = (list); (list)->prev = (list); } while (0)
+static inline int list_empty(const struct list_head *head) { return head->next == head; }
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+        entry->prev = head->prev;
+        entry->next = head;
+        head->prev->next = entry;
+        head->prev = entry;
+}
+static inline void list_del_init(struct list_head *entry)
+{
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        INIT_LIST_HEAD(entry);
+}
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define MINORMASK ((1u << 20) - 1)
+struct xarray { void **slots; unsigned long size; };
+#define DEFINE_XARRAY(name) struct xarray name = { NULL, 0 }
+static inline void *xa_load(struct xarray *xa, unsigned long index) { return index < xa->size ? xa->slots[index] : NULL; }
+static inline void *xa_store(struct xarray *xa, unsigned long index, void *entry, gfp_t flags)
+{
+        void **slots;
+        unsigned long size;
+
+        if (index >= xa->size) {
+                size = index + 1 > 2 * xa->size ? index + 1 : 2 * xa->size;
+                slots = realloc(xa->slots, size * sizeof(void *));
+                if (slots == NULL) return ERR_PTR(-ENOMEM);
+                memset(slots + xa->size, 0, (size - xa->size) * sizeof(void *));
+                xa->slots = slots;
+                xa->size = size;
+        }
+        slots = xa->slots[index];
+        xa->slots[index] = entry;
+        return slots;
+}
+static inline int xa_err(void *entry) { return IS_ERR(entry) ? PTR_ERR(entry) : 0; }
+static inline void *xa_erase(struct xarray *xa, unsigned long index) { return xa_store(xa, index, NULL, 0); }
+static inline void xa_destroy(struct xarray *xa) { free(xa->slots); xa->slots = NULL; xa->size = 0; }
+static inline void *shim_xa_next(struct xarray *xa, unsigned long *index)
+{
+        for (; *index < xa->size; (*index)++)
+                if (xa->slots[*index] != NULL) return xa->slots[*index];
+        return NULL;
+}
+#define xa_for_each(xa, index, entry) \
+        for ((index) = 0; ((entry) = shim_xa_next((xa), &(index))) != NULL; (index)++)
+#define list_for_each_entry_safe(pos, n, head, member) \
+        for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+             n = list_entry(pos->member.next, __typeof__(*pos), member); \
+             &pos->member != (head); \
+             pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/* locks and waits */
+
+struct mutex { pthread_mutex_t lock; };
+#define DEFINE_MUTEX(name) struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+static inline void mutex_init(struct mutex *m) { pthread_mutex_init(&m->lock, NULL); }
+static inline void mutex_lock(struct mutex *m) { pthread_mutex_lock(&m->lock); }
+static inline int mutex_lock_interruptible(struct mutex *m) { return pthread_mutex_lock(&m->lock); }
+static inline int mutex_trylock(struct mutex *m) { return pthread_mutex_trylock(&m->lock) == 0; }
+static inline void mutex_unlock(struct mutex *m) { pthread_mutex_unlock(&m->lock); }
+
+typedef struct { int unused; } wait_queue_head_t;
+typedef struct { int unused; } wait_queue_entry_t;
+#define DEFINE_WAIT(name) wait_queue_entry_t name = { 0 }
+#define TASK_INTERRUPTIBLE 1
+#define EPOLLIN 0x0001
+#define EPOLLOUT 0x0004
+#define EPOLLRDNORM 0x0040
+#define EPOLLWRNORM 0x0100
+static inline void init_waitqueue_head(wait_queue_head_t *q) { }
+static inline void init_wait(wait_queue_entry_t *w) { }
+static inline void prepare_to_wait_exclusive(wait_queue_head_t *q, wait_queue_entry_t *w, int state) { }
+static inline void prepare_to_wait(wait_queue_head_t *q, wait_queue_entry_t *w, int state) { }
+static inline void finish_wait(wait_queue_head_t *q, wait_queue_entry_t *w) { }
+static inline void wake_up_interruptible(wait_queue_head_t *q) { }
+static inline void wake_up_interruptible_poll(wait_queue_head_t *q, __poll_t key) { }
+static inline int signal_pending(struct task_struct *task) { return 0; }
+static inline int need_resched(void) { return 0; }
+static inline void cpu_relax(void) { }
+static inline long schedule_timeout(long timeout) { return 0; }
+static inline unsigned long msecs_to_jiffies(unsigned long msecs) { return msecs; }
+
+/* memory */
+
+#define GFP_KERNEL 0x1u
+#define GFP_ATOMIC 0x2u
+#define __GFP_NOWARN 0x4u
+#define SLAB_HWCACHE_ALIGN 0x1ul
+#define PAGE_SIZE 4096ul
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+static inline void *kmalloc(size_t size, gfp_t flags) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void kfree(const void *p) { free((void *) p); }
+static inline void *kvmalloc(size_t size, gfp_t flags) { return malloc(size); }
+static inline void kvfree(const void *p) { free((void *) p); }
+static inline void *vmalloc_user(unsigned long size) { return calloc(1, size); }
+static inline void vfree(const void *p) { free((void *) p); }
+
+struct kmem_cache { size_t size; };
+typedef struct { struct kmem_cache *cache; } mempool_t;
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, unsigned long flags, void *ctor)
+{
+        struct kmem_cache *cache = malloc(sizeof(*cache));
+        if (cache != NULL) cache->size = size;
+        return cache;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *cache) { free(cache); }
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags) { return malloc(cache->size); }
+static inline mempool_t *mempool_create_slab_pool(int reserve, struct kmem_cache *cache)
+{
+        mempool_t *pool = malloc(sizeof(*pool));
+        if (pool != NULL) pool->cache = cache;
+        return pool;
+}
+static inline void mempool_destroy(mempool_t *pool) { free(pool); }
+static inline void *mempool_alloc(mempool_t *pool, gfp_t flags) { return malloc(pool->cache->size); }
+static inline void mempool_free(void *element, mempool_t *pool) { free(element); }
+
+#define alloc_percpu(type) ((type *) calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) (p)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define DEFINE_PER_CPU(type, name) type name
+#define scnprintf snprintf
+#define this_cpu_inc(x) ((x)++)
+#define this_cpu_add(x, v) ((x) += (v))
+
+#define u64_to_user_ptr(x) ((void __user *) (uintptr_t) (x))
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) { memcpy(to, from, n); return 0; }
+
+/* iov_iter over an array of iovecs */
+
+struct iovec { void *iov_base; size_t iov_len; };
+struct iov_iter {
+        const struct iovec *__iov;
+        unsigned long nr_segs;
+        size_t iov_offset;
+        size_t count;
+};
+#define iter_iov(iter) ((iter)->__iov)
+
+struct kiocb {
+        void (*ki_complete)(struct kiocb *, long);
+        int ki_flags;
+};
+static inline bool is_sync_kiocb(struct kiocb *iocb) { return iocb->ki_complete == NULL; }
+static inline size_t iov_iter_count(const struct iov_iter *i) { return i->count; }
+static inline bool iter_is_iovec(const struct iov_iter *i) { return true; }
+
+static inline void iov_iter_init(struct iov_iter *i, const struct iovec *iov, unsigned long nr_segs, size_t count)
+{
+        i->__iov = iov;
+        i->nr_segs = nr_segs;
+        i->iov_offset = 0;
+        i->count = count;
+}
+
+static inline size_t shim_copy_iter(void *buffer, size_t bytes, struct iov_iter *i, bool to_iter)
+{
+        size_t done = 0, chunk;
+
+        bytes = bytes < i->count ? bytes : i->count;
+        while (done < bytes) {
+                chunk = i->__iov->iov_len - i->iov_offset;
+                if (chunk > bytes - done) chunk = bytes - done;
+                if (to_iter) memcpy((char *) i->__iov->iov_base + i->iov_offset, (char *) buffer + done, chunk);
+                else memcpy((char *) buffer + done, (char *) i->__iov->iov_base + i->iov_offset, chunk);
+                done += chunk;
+                i->iov_offset += chunk;
+                i->count -= chunk;
+                if (i->iov_offset == i->__iov->iov_len) {
+                        i->__iov++;
+                        i->nr_segs--;
+                        i->iov_offset = 0;
+                }
+        }
+        return done;
+}
+static inline size_t iov_iter_single_seg_count(const struct iov_iter *i)
+{
+        size_t seg = i->nr_segs > 1 ? i->__iov->iov_len - i->iov_offset : i->count;
+
+        return seg < i->count ? seg : i->count;
+}
+
+static inline void iov_iter_advance(struct iov_iter *i, size_t bytes)
+{
+        size_t chunk;
+
+        bytes = bytes < i->count ? bytes : i->count;
+        while (bytes > 0) {
+                chunk = i->__iov->iov_len - i->iov_offset;
+                if (chunk > bytes) chunk = bytes;
+                bytes -= chunk;
+                i->iov_offset += chunk;
+                i->count -= chunk;
+                if (i->iov_offset == i->__iov->iov_len) {
+                        i->__iov++;
+                        i->nr_segs--;
+                        i->iov_offset = 0;
+                }
+        }
+}
+static inline void iov_iter_truncate(struct iov_iter *i, size_t count) { if (i->count > count) i->count = count; }
+static inline void iov_iter_reexpand(struct iov_iter *i, size_t count) { i->count = count; }
+static inline size_t copy_from_iter(void *to, size_t bytes, struct iov_iter *i) { return shim_copy_iter(to, bytes, i, false); }
+static inline size_t copy_to_iter(const void *from, size_t bytes, struct iov_iter *i) { return shim_copy_iter((void *) from, bytes, i, true); }
+
+/* deferred work, run by engine_drain() */
+
+struct work_struct {
+        void (*func)(struct work_struct *);
+        struct work_struct *next;
+        bool pending;
+};
+struct workqueue_struct { struct work_struct *head, *tail; };
+#define WQ_UNBOUND 0x2u
+#define WQ_HIGHPRI 0x10u
+#define INIT_WORK(work, function) do { (work)->func = (function); (work)->next = NULL; (work)->pending = false; } while (0)
+
+static inline struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags, int max_active)
+{
+        return calloc(1, sizeof(struct workqueue_struct));
+}
+static inline void destroy_workqueue(struct workqueue_struct *wq) { free(wq); }
+static inline bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+        if (work->pending) return false;
+        work->pending = true;
+        work->next = NULL;
+        if (wq->tail != NULL) wq->tail->next = work;
+        else wq->head = work;
+        wq->tail = work;
+        return true;
+}
+// work only runs in shim_run_work(), which the engine calls before flushing
+static inline bool flush_work(struct work_struct *work) { return false; }
+
+static inline int shim_run_work(struct workqueue_struct *wq)
+{
+        struct work_struct *work;
+        int runs = 0;
+
+        while ((work = wq->head) != NULL) {
+                wq->head = work->next;
+                if (wq->head == NULL) wq->tail = NULL;
+                work->pending = false;
+                work->func(work);
+                runs++;
+        }
+        return runs;
+}
+
+/* eventfd, never bound in user space */
+
+struct eventfd_ctx;
+static inline void eventfd_signal(struct eventfd_ctx *ctx) { }
+static inline void eventfd_ctx_put(struct eventfd_ctx *ctx) { }
+
+/* time, math, debugfs */
+
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_MSEC 1000000L
+#define KTIME_MAX ((long long) (~0ULL >> 1))
+typedef long long ktime_t;
+enum hrtimer_mode { HRTIMER_MODE_ABS };
+static inline ktime_t ns_to_ktime(u64 ns) { return ns; }
+static inline int schedule_hrtimeout(ktime_t *expires, enum hrtimer_mode mode) { return 0; }
+static inline u64 ktime_get_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+#define do_div(n, base) ({ u32 __rem = (n) % (base); (n) /= (base); __rem; })
+
+struct file;
+struct dentry;
+struct seq_file;
+struct file_operations {
+        void *owner;
+        ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+};
+#define IS_ERR_OR_NULL(p) ((p) == NULL)
+#define DEFINE_SHOW_ATTRIBUTE(name) \
+        static const struct file_operations name##_fops __attribute__((unused)) = { .owner = (void *) name##_show }
+static inline int seq_printf(struct seq_file *m, const char *fmt, ...) { return 0; }
+static inline void seq_putc(struct seq_file *m, char c) { }
+static inline struct dentry *debugfs_create_dir(const char *name, struct dentry *parent) { return NULL; }
+static inline struct dentry *debugfs_create_file(const char *name, int mode, struct dentry *parent, void *data,
+        const struct file_operations *fops) { return NULL; }
+static inline void debugfs_remove_recursive(struct dentry *dentry) { }
+static inline int kstrtoint_from_user(const char __user *s, size_t count, unsigned int base, int *res)
+{
+        *res = (int) strtol(s, NULL, base);
+        return 0;
+}
+
+/* tracepoints compile to nothing */
+
+#define TP_PROTO(...) __VA_ARGS__
+#define TP_ARGS(...) __VA_ARGS__
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) static inline void trace_##name(proto) { }
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) static inline void trace_##name(proto) { }
+
+#endif
@@ -1,78 +1,333 @@
 #include "info.h"
+#include "ring.h"
+#include "pool.h"
+#include "multi_flow_trace.h"
+#include "stats.h"
+#include <linux/eventfd.h>
+
+#ifndef _WRITEH_
+#define _WRITEH_
+
+/*
+ * Completion record of an asynchronous (io_uring or AIO) low priority write:
+ * its kiocb is completed with bytes by the deferred run that makes them
+ * visible, instead of by write_iter itself.
+ */
+typedef struct _write_completion
+{
+        struct kiocb *iocb;
+        ssize_t bytes;
+        struct _write_completion *next;
+
+} write_completion;
+
 
 size_t write(data_segment *, object_state *);
-void deferred_write(unsigned long);
-int put_work(object_state *, data_segment *, int, int, gfp_t);
+data_segment *packing_target(object_state *, int);
+void deferred_write(struct work_struct *);
+int put_work(object_state *, data_segment *, size_t);
+void queue_completion(object_state *, write_completion *, struct kiocb *, ssize_t);
+void complete_writes(write_completion *);
+void queue_sequence(object_state *, session *);
+void commit_sequences(object_state *);
+int init_deferred_queue(void);
+void destroy_deferred_queue(void);
+int build_segments(struct iov_iter *, size_t, int, gfp_t, data_segment **);
 
 
-typedef struct _packed_work
-{
-        int major;
-        int minor;
-        object_state *the_stream_state;
-        data_segment *new_segment;
-        struct work_struct  the_work;
+static int wq_unbound = 1;
+module_param(wq_unbound, int, 0440);
+MODULE_PARM_DESC(wq_unbound, "If set, deferred writes run on an unbound workqueue (not tied to the CPU of the writer).");
+
+static int wq_highpri = 0;
+module_param(wq_highpri, int, 0440);
+MODULE_PARM_DESC(wq_highpri, "If set, deferred writes run on high priority kworkers.");
+
+static int wq_max_active = 0;
+module_param(wq_max_active, int, 0440);
+MODULE_PARM_DESC(wq_max_active, "Maximum number of flows whose deferred writes run concurrently (0 for the default).");
 
-} packed_work;
+static struct workqueue_struct *deferred_queue;
+
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define iter_iovec_array(iter) iter_iov(iter)
+#else
+#define iter_iovec_array(iter) ((iter)->iov)
+#endif
 
 
 size_t write( data_segment *new_segment, object_state *current_stream_state ) {
-        data_segment *tail;
-        
-        tail =  current_stream_state -> tail;
 
-        new_segment -> previous = tail->previous;
-        new_segment -> next = tail;
+        new_segment -> next = NULL;
 
-        tail->previous -> next = new_segment;
-        tail->previous = new_segment;
+        // publishes the segment before its bytes are accounted for, see read()
+        smp_store_release(&(current_stream_state -> tail -> next), new_segment);
+        current_stream_state -> tail = new_segment;
 
-        current_stream_state -> valid_bytes += new_segment -> actual_size;
+        smp_mb__before_atomic();
+        atomic_add(new_segment -> actual_size, &(current_stream_state -> valid_bytes));
 
         return new_segment -> actual_size;
 }
 
 
-void deferred_write(unsigned long data) {
-        packed_work *the_task = (packed_work *) container_of( (void*) data, packed_work, the_work );
-        AUDIT printk("%s kworker %d handles async write operation on device [MAJOR: %d, minor: %d]",
-               MODNAME, current->pid, the_task->major, the_task->minor);
+/*
+ * Segment whose spare room a stream write may append to, NULL if none.
+ * Deferred bytes go to the last pending segment, which readers never see.
+ * Visible bytes go to the tail only when readers take the same lock as
+ * writers: with split locks a reader could retire the tail (see
+ * consume_bytes) while it is being appended to. The dummy head has no room.
+ */
+data_segment *packing_target( object_state *current_stream_state, int deferred ) {
+
+        if (deferred)
+                return current_stream_state -> pending_tail;
+        if (current_stream_state -> split_locks || current_stream_state -> tail == current_stream_state -> head)
+                return NULL;
+        return current_stream_state -> tail;
+}
+
+
+/*
+ * Runs on the module workqueue and appends, under a single acquisition of the
+ * lock, every segment (or ring byte) queued by put_work since the last run.
+ */
+void deferred_write(struct work_struct *work) {
+        object_state *current_stream_state = container_of(work, object_state, deferred_work);
+        data_segment *chain, *next;
+        write_completion *completions;
+        int len, segments;
+
+        AUDIT printk("%s kworker %d handles async write operations on device [minor: %d]",
+               MODNAME, current->pid, current_stream_state->minor);
+
+        mutex_lock( producer_mutex(current_stream_state) );
+        if (current_stream_state->storage == RING_STORAGE) {
+                len = atomic_xchg(&(current_stream_state->pending_bytes), 0);
+                segments = 0;
+                ring_commit(current_stream_state, len);
+        } else {
+                chain = current_stream_state->pending_head;
+                segments = current_stream_state->pending_segments;
+                current_stream_state->pending_head = NULL;
+                current_stream_state->pending_tail = NULL;
+                current_stream_state->pending_segments = 0;
 
-        mutex_lock( &( the_task->the_stream_state->operation_synchronizer) );
-        the_task->the_stream_state->pending_bytes -= write(the_task->new_segment, the_task->the_stream_state);
-        mutex_unlock( &( the_task->the_stream_state->operation_synchronizer) );
+                len = 0;
+                while (chain != NULL) {
+                        next = chain->next;
+                        len += write(chain, current_stream_state);
+                        chain = next;
+                }
+                atomic_sub(len, &(current_stream_state->pending_bytes));
+        }
+        // a run queued while the previous one was draining may find nothing left
+        if (len > 0)
+                account_deferred(current_stream_state, segments);
 
-        wake_up_interruptible(&(the_task->the_stream_state->wq));
+        // records and sequences are queued under the same lock as their bytes, so all of them are visible now
+        commit_sequences(current_stream_state);
+        completions = current_stream_state->completions_head;
+        current_stream_state->completions_head = NULL;
+        current_stream_state->completions_tail = NULL;
+        mutex_unlock( producer_mutex(current_stream_state) );
 
-        kfree(the_task);
+        trace_multi_flow_deferred_write(current_stream_state->minor, len, segments);
+
+        wake_up_readers(current_stream_state);
+        complete_writes(completions);
 
         module_put(THIS_MODULE);
 }
 
 
-int put_work( object_state *current_stream_state, data_segment *new_segment, int major, int minor, gfp_t flags ) {
-        
-        packed_work *the_task;
-        int ret;
+/*
+ * Queues a segment (or len bytes already reserved in the ring when
+ * new_segment is NULL) for the deferred work of the flow; called with the
+ * producer lock held. The work is queued only if not already pending, so a burst of
+ * writes is drained by a single run.
+ */
+int put_work( object_state *current_stream_state, data_segment *new_segment, size_t len ) {
 
         if(!try_module_get(THIS_MODULE))
                 return -ENODEV;
 
-        the_task = (packed_work *)kzalloc(sizeof(packed_work), flags);
-        if(unlikely(the_task == NULL))
+        if (new_segment != NULL) {
+                new_segment -> next = NULL;
+                if (current_stream_state -> pending_tail != NULL)
+                        current_stream_state -> pending_tail -> next = new_segment;
+                else
+                        current_stream_state -> pending_head = new_segment;
+                current_stream_state -> pending_tail = new_segment;
+                current_stream_state -> pending_segments++;
+        }
+
+        if (atomic_read(&(current_stream_state -> pending_bytes)) == 0)
+                current_stream_state -> pending_since = ktime_get_ns();
+        atomic_add(len, &(current_stream_state -> pending_bytes));
+
+        if (!queue_work(deferred_queue, &(current_stream_state -> deferred_work)))
+                module_put(THIS_MODULE);
+
+        return len;
+}
+
+
+/*
+ * Appends the completion record of an asynchronous write of bytes, already
+ * handed to put_work; called with the producer lock held, before the deferred
+ * run draining those bytes can take it.
+ */
+void queue_completion( object_state *current_stream_state, write_completion *completion, struct kiocb *iocb, ssize_t bytes ) {
+
+        completion -> iocb = iocb;
+        completion -> bytes = bytes;
+        completion -> next = NULL;
+
+        if (current_stream_state -> completions_tail != NULL)
+                current_stream_state -> completions_tail -> next = completion;
+        else
+                current_stream_state -> completions_head = completion;
+        current_stream_state -> completions_tail = completion;
+}
+
+
+void complete_writes( write_completion *completion ) {
+
+        write_completion *next;
+
+        while (completion != NULL) {
+                next = completion -> next;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+                completion -> iocb -> ki_complete(completion -> iocb, completion -> bytes);
+#else
+                completion -> iocb -> ki_complete(completion -> iocb, completion -> bytes, 0);
+#endif
+                kfree(completion);
+                completion = next;
+        }
+}
+
+
+/*
+ * Gives the next sequence number of the session on the class of the flow to
+ * a write just handed to put_work, and links it to the flow so that the
+ * deferred run making the write visible publishes the number. Called with
+ * the producer lock held.
+ */
+void queue_sequence( object_state *current_stream_state, session *session ) {
+
+        write_sequence *sequence = &(session -> sequences[current_stream_state -> priority]);
+
+        atomic64_inc(&(sequence -> sequence));
+        if (list_empty(&(sequence -> pending_link)))
+                list_add_tail(&(sequence -> pending_link), &(current_stream_state -> pending_sessions));
+}
+
+
+// every write queued so far is committed by this run; called with the producer lock held
+void commit_sequences( object_state *current_stream_state ) {
+
+        write_sequence *sequence, *next;
+        struct eventfd_ctx *eventfd;
+
+        list_for_each_entry_safe(sequence, next, &(current_stream_state -> pending_sessions), pending_link) {
+                atomic64_set(&(sequence -> committed), atomic64_read(&(sequence -> sequence)));
+                list_del_init(&(sequence -> pending_link));
+                // BIND_EVENTFD may swap it, then waits for the runs holding the producer lock
+                eventfd = READ_ONCE(sequence -> session -> eventfd);
+                if (eventfd != NULL)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+                        eventfd_signal(eventfd);
+#else
+                        eventfd_signal(eventfd, 1);
+#endif
+        }
+}
+
+
+int init_deferred_queue(void) {
+
+        unsigned int flags = 0;
+
+        if (wq_unbound)
+                flags |= WQ_UNBOUND;
+        if (wq_highpri)
+                flags |= WQ_HIGHPRI;
+
+        deferred_queue = alloc_workqueue("multi_flow", flags, wq_max_active);
+        if (deferred_queue == NULL)
                 return -ENOMEM;
 
-        the_task -> major = major;
-        the_task -> minor = minor;
-        the_task -> the_stream_state = current_stream_state;
-        the_task -> new_segment = new_segment;
+        return 0;
+}
+
+
+void destroy_deferred_queue(void) {
+        if (deferred_queue != NULL)
+                destroy_workqueue(deferred_queue);
+        deferred_queue = NULL;
+}
+
+
+/*
+ * Copies len bytes out of the iterator into a chain of new segments linked
+ * through next: a single segment, or one per (non-empty) iovec when
+ * per_iovec is set. Returns the bytes copied, which are less than len only
+ * if user memory faulted.
+ */
+int build_segments( struct iov_iter *from, size_t len, int per_iovec, gfp_t flags, data_segment **chain ) {
+
+        data_segment *new_segment, **link;
+        const struct iovec *iov;
+        size_t copied, segment_len, skip;
+        unsigned long index;
+
+        *chain = NULL;
+        link = chain;
+        copied = 0;
+        index = 0;
 
-        ret = new_segment -> actual_size;
+        iov = (per_iovec && iter_is_iovec(from)) ? iter_iovec_array(from) : NULL;
+        skip = (iov != NULL) ? from -> iov_offset : 0;
 
-        __INIT_WORK(&(the_task -> the_work), (void*) deferred_write, (unsigned long)(&(the_task -> the_work)));
-        schedule_work( &the_task -> the_work );
+        while (copied < len) {
+
+                if (iov != NULL) {
+                        segment_len = iov[index].iov_len - skip;
+                        skip = 0;
+                        index++;
+                        if (segment_len == 0)
+                                continue;
+                        segment_len = MIN(segment_len, len - copied);
+                } else {
+                        segment_len = len - copied;
+                }
+
+                new_segment = alloc_data_segment(segment_len, flags);
+                if (unlikely(new_segment == NULL)) {
+                        free_segment_chain(*chain);
+                        *chain = NULL;
+                        return -ENOMEM;
+                }
+
+                new_segment -> actual_size = copy_from_iter(new_segment -> buffer, segment_len, from);
+                if (unlikely(new_segment -> actual_size == 0)) {
+                        free_data_segment(new_segment, 0);
+                        break;
+                }
+
+                *link = new_segment;
+                link = &(new_segment -> next);
+                copied += new_segment -> actual_size;
+
+                if (unlikely(new_segment -> actual_size != segment_len))
+                        break;
+        }
+
+        return copied;
+}
 
-        current_stream_state -> pending_bytes += ret;
 
-        return ret;
-}
\ No newline at end of file
+#endif